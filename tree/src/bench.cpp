@@ -0,0 +1,601 @@
+// Throughput benchmark of TreeMap and its alternatives against std::map.
+//
+//     g++ -std=c++23 -O2 -DNDEBUG bench.cpp -o bench
+//     ./bench [--sizes=1000,1000000,100000000] [--ops=1000000]
+//
+// Every combination of key type, key distribution, size and backend runs the workloads
+// insert, lookup, iterate, mixed and remove on one map, in that order. For each one it
+// prints ns/op, heap allocations per op, and last-level cache misses per op where perf
+// events are available. The heap column is the growth in live heap bytes caused by the inserts.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "btree.hpp"
+#include "flatmap.hpp"
+#include "rbtree.hpp"
+
+// Every heap allocation in the process goes through these, so workloads can count them and
+// the bytes they keep live. Each block is preceded by a header recording its requested size,
+// one default alignment wide for plain `new` and one requested alignment wide otherwise.
+// They stay out of line so GCC does not pair the inlined free() with `new` and warn.
+static size_t allocations = 0;
+static size_t live_bytes = 0;
+
+static constexpr size_t HEADER = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+static void* track(void* base, size_t header, size_t size) {
+    ++ allocations;
+    live_bytes += size;
+    void* ptr = static_cast<std::byte*>(base) + header;
+    reinterpret_cast<size_t*>(ptr)[-1] = size;
+    return ptr;
+}
+
+static void untrack(void* ptr, size_t header) {
+    if (! ptr) return;
+    live_bytes -= reinterpret_cast<size_t*>(ptr)[-1];
+    std::free(static_cast<std::byte*>(ptr) - header);
+}
+
+void* operator new(size_t size) {
+    if (void* base = std::malloc(HEADER + size))
+        return track(base, HEADER, size);
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    size_t alignment = static_cast<size_t>(align);
+    if (void* base = std::aligned_alloc(alignment, (alignment + size + alignment - 1) / alignment * alignment))
+        return track(base, alignment, size);
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+    untrack(ptr, HEADER);
+}
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+    untrack(ptr, HEADER);
+}
+[[gnu::noinline]] void operator delete(void* ptr, std::align_val_t align) noexcept {
+    untrack(ptr, static_cast<size_t>(align));
+}
+[[gnu::noinline]] void operator delete(void* ptr, size_t, std::align_val_t align) noexcept {
+    untrack(ptr, static_cast<size_t>(align));
+}
+
+// Results are folded in here so the optimizer cannot drop the work that produced them.
+static volatile uint64_t sink = 0;
+
+// Last-level cache misses of this thread, through perf events. Reports nothing when the
+// kernel refuses (e.g. perf_event_paranoid or containers) or off Linux.
+struct CacheMisses {
+private:
+    int fd = -1;
+
+public:
+    CacheMisses() {
+#ifdef __linux__
+        perf_event_attr attr {};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    CacheMisses(const CacheMisses&) = delete;
+    CacheMisses& operator=(const CacheMisses&) = delete;
+
+    ~CacheMisses() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    std::optional<uint64_t> stop() {
+#ifdef __linux__
+        if (fd < 0) return std::nullopt;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) == sizeof(count))
+            return count;
+#endif
+        return std::nullopt;
+    }
+};
+
+enum class Distribution {
+    UNIFORM,
+    SEQUENTIAL,
+    ZIPF,
+};
+
+std::string_view distribution_name(Distribution dist) {
+    switch (dist) {
+        case Distribution::UNIFORM:
+            return "uniform";
+        case Distribution::SEQUENTIAL:
+            return "sequential";
+        case Distribution::ZIPF:
+            return "zipf";
+    }
+    return "";
+}
+
+// Zipf-distributed ranks in [0, n) with skew `theta`, after Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases". Setup is O(n), draws are O(1).
+struct Zipf {
+private:
+    size_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    std::uniform_real_distribution<double> uniform;
+
+    static double _zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++ i)
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+public:
+    explicit Zipf(size_t n, double theta = 0.99) :
+        n(n),
+        theta(theta),
+        alpha(1 / (1 - theta)),
+        zetan(_zeta(n, theta)),
+        eta((1 - std::pow(2.0 / n, 1 - theta)) / (1 - _zeta(2, theta) / zetan)) {}
+
+    template<typename Rng>
+    size_t operator()(Rng& rng) {
+        double u = uniform(rng);
+        double uz = u * zetan;
+        if (uz < 1) return 0;
+        if (uz < 1 + std::pow(0.5, theta)) return 1;
+        return std::min(n - 1, static_cast<size_t>(n * std::pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+// Odd multiplier, so this is a bijection that scatters neighbouring indices over the key space.
+uint64_t scramble(uint64_t index) {
+    return index * 0x9E3779B97F4A7C15ull;
+}
+
+// Key indices for the inserts: all n indices in random or ascending order, or n Zipf draws.
+std::vector<uint64_t> insert_stream(Distribution dist, size_t n, std::mt19937_64& rng) {
+    std::vector<uint64_t> stream(n);
+    if (dist == Distribution::ZIPF) {
+        Zipf zipf(n);
+        for (auto& index : stream) index = scramble(zipf(rng));
+        return stream;
+    }
+    std::iota(stream.begin(), stream.end(), 0);
+    if (dist == Distribution::UNIFORM) {
+        std::shuffle(stream.begin(), stream.end(), rng);
+        for (auto& index : stream) index = scramble(index);
+    }
+    return stream;
+}
+
+// Key indices for lookups and the mixed workload over the same domain.
+std::vector<uint64_t> query_stream(Distribution dist, size_t n, size_t count, std::mt19937_64& rng) {
+    std::vector<uint64_t> stream(count);
+    switch (dist) {
+        case Distribution::UNIFORM: {
+            std::uniform_int_distribution<uint64_t> pick(0, n - 1);
+            for (auto& index : stream) index = scramble(pick(rng));
+            break;
+        }
+        case Distribution::SEQUENTIAL:
+            for (size_t i = 0; i < count; ++ i) stream[i] = i % n;
+            break;
+        case Distribution::ZIPF: {
+            Zipf zipf(n);
+            for (auto& index : stream) index = scramble(zipf(rng));
+            break;
+        }
+    }
+    return stream;
+}
+
+template<typename K>
+K make_key(uint64_t index);
+
+template<>
+uint64_t make_key<uint64_t>(uint64_t index) {
+    return index;
+}
+
+// Long enough to live outside the small string buffer, as most real string keys do.
+template<>
+std::string make_key<std::string>(uint64_t index) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "key:%020llu", static_cast<unsigned long long>(index));
+    return buffer;
+}
+
+template<typename K>
+std::string_view key_name();
+template<>
+std::string_view key_name<uint64_t>() {
+    return "u64";
+}
+template<>
+std::string_view key_name<std::string>() {
+    return "string";
+}
+
+// Backends share one small interface. `incremental` is false for maps whose single
+// inserts and removals are linear, which load in bulk and skip the writing workloads.
+template<typename K, typename V>
+struct StdMapBackend {
+    static constexpr std::string_view name = "std::map";
+    static constexpr bool incremental = true;
+
+    std::map<K, V> map;
+
+    void load(const std::vector<K>& keys) {
+        for (const K& key : keys) map.insert_or_assign(key, V());
+    }
+    void set(const K& key, V value) {
+        map.insert_or_assign(key, value);
+    }
+    bool find(const K& key) const {
+        return map.find(key) != map.end();
+    }
+    bool remove(const K& key) {
+        return map.erase(key) > 0;
+    }
+    uint64_t iterate() const {
+        uint64_t sum = 0;
+        for (const auto& [ key, value ] : map) sum += value;
+        return sum;
+    }
+};
+
+template<typename Map>
+struct TreeBackend {
+    static constexpr bool incremental = true;
+
+    Map map;
+
+    template<typename K>
+    void load(const std::vector<K>& keys) {
+        for (const K& key : keys) map.set(key, {});
+    }
+    template<typename K, typename V>
+    void set(const K& key, V value) {
+        map.set(key, value);
+    }
+    template<typename K>
+    bool find(const K& key) const {
+        return map.find(key) != nullptr;
+    }
+    template<typename K>
+    bool remove(const K& key) {
+        return map.remove(key);
+    }
+    uint64_t iterate() {
+        uint64_t sum = 0;
+        for (auto [ key, value ] : map.entries) sum += value;
+        return sum;
+    }
+};
+
+template<typename K, typename V>
+struct HeapTreeBackend : TreeBackend<TreeMap<K, V>> {
+    static constexpr std::string_view name = "TreeMap<Heap>";
+};
+
+template<typename K, typename V>
+struct ArenaTreeBackend : TreeBackend<TreeMap<K, V, std::compare_three_way, ArenaNodes>> {
+    static constexpr std::string_view name = "TreeMap<Arena>";
+};
+
+template<typename K, typename V>
+struct BTreeBackend : TreeBackend<BTreeMap<K, V>> {
+    static constexpr std::string_view name = "BTreeMap";
+};
+
+template<typename K, typename V>
+struct FlatBackend : TreeBackend<FlatTreeMap<K, V>> {
+    static constexpr std::string_view name = "FlatTreeMap";
+    static constexpr bool incremental = false;
+
+    void load(const std::vector<K>& keys) {
+        std::vector<std::pair<K, V>> batch;
+        batch.reserve(keys.size());
+        for (const K& key : keys) batch.emplace_back(key, V());
+        this->map.insert_batch(batch.begin(), batch.end());
+    }
+};
+
+// Built once from sorted, distinct keys, so sorting them is part of the load.
+template<typename K, typename V>
+struct FrozenBackend : TreeBackend<FrozenTreeMap<K, V, std::compare_three_way>> {
+    static constexpr std::string_view name = "FrozenTreeMap";
+    static constexpr bool incremental = false;
+
+    void load(const std::vector<K>& keys) {
+        std::vector<K> sorted = keys;
+        std::ranges::sort(sorted);
+        auto duplicates = std::ranges::unique(sorted);
+        sorted.erase(duplicates.begin(), duplicates.end());
+        std::vector<std::pair<K, V>> batch;
+        batch.reserve(sorted.size());
+        for (const K& key : sorted) batch.emplace_back(key, V());
+        this->map = FrozenTreeMap<K, V, std::compare_three_way>::from_sorted(batch.begin(), batch.end());
+    }
+};
+
+// Every write publishes a new version, as a persistent map is used.
+template<typename K, typename V>
+struct PersistentBackend : TreeBackend<PersistentTreeMap<K, V>> {
+    static constexpr std::string_view name = "PersistentTreeMap";
+
+    void load(const std::vector<K>& keys) {
+        for (const K& key : keys) this->map = this->map.set(key, V());
+    }
+    void set(const K& key, V value) {
+        this->map = this->map.set(key, value);
+    }
+    bool remove(const K& key) {
+        size_t size = this->map.size();
+        this->map = this->map.remove(key);
+        return this->map.size() < size;
+    }
+    uint64_t iterate() const {
+        uint64_t sum = 0;
+        for (auto [ key, value ] : this->map) sum += value;
+        return sum;
+    }
+};
+
+// Driven from a single thread, so this measures the cost of the synchronization alone.
+template<typename K, typename V>
+struct ConcurrentBackend : TreeBackend<ConcurrentTreeMap<K, V>> {
+    static constexpr std::string_view name = "ConcurrentTreeMap";
+
+    bool find(const K& key) const {
+        return this->map.find(key).has_value();
+    }
+    uint64_t iterate() const {
+        return this->map.read([](const auto& version) {
+            uint64_t sum = 0;
+            for (auto [ key, value ] : version) sum += value;
+            return sum;
+        });
+    }
+};
+
+template<typename K, typename V>
+struct ShardedBackend : TreeBackend<ShardedTreeMap<K, V>> {
+    static constexpr std::string_view name = "ShardedTreeMap";
+
+    bool find(const K& key) const {
+        return this->map.find(key).has_value();
+    }
+    uint64_t iterate() const {
+        uint64_t sum = 0;
+        for (auto [ key, value ] : this->map.entries()) sum += value;
+        return sum;
+    }
+};
+
+struct Sample {
+    double ns_per_op;
+    double allocations_per_op;
+    std::optional<double> misses_per_op;
+};
+
+template<typename F>
+Sample measure(size_t ops, F&& work) {
+    static CacheMisses misses;
+    size_t allocations_before = allocations;
+    misses.start();
+    auto start = std::chrono::steady_clock::now();
+    std::forward<F>(work)();
+    auto stop = std::chrono::steady_clock::now();
+    std::optional<uint64_t> missed = misses.stop();
+
+    ops = std::max<size_t>(ops, 1);
+    Sample sample {
+        std::chrono::duration<double, std::nano>(stop - start).count() / ops,
+        static_cast<double>(allocations - allocations_before) / ops,
+        std::nullopt,
+    };
+    if (missed) sample.misses_per_op = static_cast<double>(*missed) / ops;
+    return sample;
+}
+
+void report(std::string_view backend, std::string_view key, Distribution dist, size_t n,
+            std::string_view workload, const std::optional<Sample>& sample, std::optional<double> heap_mib = std::nullopt) {
+    std::cout << std::left
+        << std::setw(20) << backend
+        << std::setw(8) << key
+        << std::setw(12) << distribution_name(dist)
+        << std::setw(11) << n
+        << std::setw(10) << workload
+        << std::right << std::fixed;
+    if (! sample) {
+        std::cout << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(12) << "-" << std::setw(10) << "-\n";
+        return;
+    }
+    std::cout << std::setprecision(1) << std::setw(12) << sample->ns_per_op
+        << std::setprecision(3) << std::setw(12) << sample->allocations_per_op;
+    if (sample->misses_per_op)
+        std::cout << std::setprecision(2) << std::setw(12) << *sample->misses_per_op;
+    else
+        std::cout << std::setw(12) << "n/a";
+    if (heap_mib)
+        std::cout << std::setprecision(1) << std::setw(10) << *heap_mib;
+    else
+        std::cout << std::setw(10) << "";
+    std::cout << "\n";
+}
+
+template<template<typename, typename> typename Backend, typename K>
+void run(Distribution dist, size_t n, size_t max_ops) {
+    using V = uint64_t;
+    using B = Backend<K, V>;
+    std::mt19937_64 rng(n);
+
+    std::vector<K> inserts;
+    inserts.reserve(n);
+    for (uint64_t index : insert_stream(dist, n, rng)) inserts.push_back(make_key<K>(index));
+    std::vector<K> queries;
+    size_t query_count = std::min(n, max_ops);
+    queries.reserve(query_count);
+    for (uint64_t index : query_stream(dist, n, query_count, rng)) queries.push_back(make_key<K>(index));
+    std::vector<uint8_t> choices(query_count);
+    for (auto& choice : choices) choice = rng() % 4;
+
+    auto backend = std::make_unique<B>();
+
+    size_t live_before = live_bytes;
+    Sample insert = measure(n, [&] {
+        if constexpr (B::incremental)
+            for (const K& key : inserts) backend->set(key, V());
+        else
+            backend->load(inserts);
+    });
+    double heap_mib = (static_cast<double>(live_bytes) - static_cast<double>(live_before)) / (1 << 20);
+    report(B::name, key_name<K>(), dist, n, "insert", insert, heap_mib);
+
+    Sample lookup = measure(query_count, [&] {
+        uint64_t found = 0;
+        for (const K& key : queries) found += backend->find(key);
+        sink = sink + found;
+    });
+    report(B::name, key_name<K>(), dist, n, "lookup", lookup);
+
+    Sample iterate = measure(n, [&] {
+        sink = sink + backend->iterate();
+    });
+    report(B::name, key_name<K>(), dist, n, "iterate", iterate);
+
+    if constexpr (! B::incremental) {
+        report(B::name, key_name<K>(), dist, n, "mixed", std::nullopt);
+        report(B::name, key_name<K>(), dist, n, "remove", std::nullopt);
+        return;
+    }
+    else {
+        // Half lookups, a quarter each of inserts and removals, over the query keys
+        Sample mixed = measure(query_count, [&] {
+            uint64_t found = 0;
+            for (size_t i = 0; i < query_count; ++ i) {
+                if (choices[i] < 2) found += backend->find(queries[i]);
+                else if (choices[i] == 2) backend->set(queries[i], V(i));
+                else found += backend->remove(queries[i]);
+            }
+            sink = sink + found;
+        });
+        report(B::name, key_name<K>(), dist, n, "mixed", mixed);
+
+        std::shuffle(inserts.begin(), inserts.end(), rng);
+        Sample remove = measure(n, [&] {
+            uint64_t removed = 0;
+            for (const K& key : inserts) removed += backend->remove(key);
+            sink = sink + removed;
+        });
+        report(B::name, key_name<K>(), dist, n, "remove", remove);
+    }
+}
+
+template<typename K>
+void run_all(Distribution dist, size_t n, size_t max_ops) {
+    run<StdMapBackend, K>(dist, n, max_ops);
+    run<HeapTreeBackend, K>(dist, n, max_ops);
+    run<ArenaTreeBackend, K>(dist, n, max_ops);
+    run<BTreeBackend, K>(dist, n, max_ops);
+    run<FlatBackend, K>(dist, n, max_ops);
+    run<FrozenBackend, K>(dist, n, max_ops);
+    run<PersistentBackend, K>(dist, n, max_ops);
+    run<ConcurrentBackend, K>(dist, n, max_ops);
+    run<ShardedBackend, K>(dist, n, max_ops);
+}
+
+std::vector<size_t> parse_sizes(std::string_view list) {
+    std::vector<size_t> sizes;
+    while (! list.empty()) {
+        size_t comma = list.find(',');
+        sizes.push_back(std::stoull(std::string(list.substr(0, comma))));
+        list = comma == std::string_view::npos ? "" : list.substr(comma + 1);
+    }
+    return sizes;
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+    size_t max_ops = 1000000;
+    for (int i = 1; i < argc; ++ i) {
+        std::string_view arg = argv[i];
+        if (arg.starts_with("--sizes="))
+            sizes = parse_sizes(arg.substr(8));
+        else if (arg.starts_with("--ops="))
+            max_ops = std::stoull(std::string(arg.substr(6)));
+        else {
+            std::cerr << "usage: " << argv[0] << " [--sizes=N,N,...] [--ops=N]\n";
+            return 1;
+        }
+    }
+
+    std::cout << std::left
+        << std::setw(20) << "backend"
+        << std::setw(8) << "key"
+        << std::setw(12) << "dist"
+        << std::setw(11) << "n"
+        << std::setw(10) << "workload"
+        << std::right
+        << std::setw(12) << "ns/op"
+        << std::setw(12) << "allocs/op"
+        << std::setw(12) << "misses/op"
+        << std::setw(10) << "heap MiB"
+        << "\n";
+
+    for (size_t n : sizes) {
+        for (Distribution dist : { Distribution::UNIFORM, Distribution::SEQUENTIAL, Distribution::ZIPF }) {
+            run_all<uint64_t>(dist, n, max_ops);
+            run_all<std::string>(dist, n, max_ops);
+        }
+    }
+
+    return 0;
+}
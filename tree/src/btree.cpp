@@ -0,0 +1,91 @@
+#include <cassert>
+#include <compare>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "btree.hpp"
+
+using SmallTree = BTreeMap<int, int, std::compare_three_way, 32>;
+
+// Walks the leaf chain both ways, so splits and merges must keep the links intact.
+bool same_entries(const SmallTree& tree, const std::map<int, int>& expected) {
+    if (tree.size != expected.size())
+        return false;
+    auto it = expected.begin();
+    for (auto entry = tree.entry_cbegin(); entry != tree.entry_cend(); ++ entry, ++ it) {
+        if ((*entry).first != it->first || (*entry).second != it->second)
+            return false;
+    }
+    auto back = expected.rbegin();
+    for (auto entry = tree.entry_cend(); entry != tree.entry_cbegin(); ++ back) {
+        -- entry;
+        if ((*entry).first != back->first)
+            return false;
+    }
+    return true;
+}
+
+// Random inserts and removes on small nodes, so leaves and inner nodes keep splitting,
+// borrowing and merging, against the same steps on std::map.
+bool check_rebalancing() {
+    std::mt19937 rng(1);
+    SmallTree tree;
+    std::map<int, int> expected;
+    bool matches = true;
+    for (int round = 0; round < 40; ++ round) {
+        // Grow on even rounds, shrink on odd ones
+        int range = 2000;
+        for (int i = 0; i < 1000; ++ i) {
+            int key = rng() % range;
+            if (rng() % 4 < (round % 2 ? 1u : 3u)) {
+                tree.set(key, round);
+                expected.insert_or_assign(key, round);
+            }
+            else {
+                bool removed = tree.remove(key);
+                matches = matches && removed == (expected.erase(key) > 0);
+            }
+        }
+        matches = matches && same_entries(tree, expected);
+        for (int key = 0; key < range; key += 7) {
+            const int* value = std::as_const(tree).find(key);
+            auto it = expected.find(key);
+            matches = matches && (value ? it != expected.end() && *value == it->second : it == expected.end());
+        }
+    }
+    for (auto [ key, _ ] : std::map(expected)) {
+        tree.remove(key);
+        expected.erase(key);
+    }
+    return matches && tree.empty() && same_entries(tree, expected);
+}
+
+int main() {
+    std::vector<int> keys = { 1, 2, 3, 4, 8 ,7, 6, 5 };
+    BTreeMap<int, int, std::compare_three_way, 32> tree;
+
+    for (int key : keys) {
+        tree[key] = key * key;
+    }
+
+    tree.remove(8);
+    tree.print();
+
+    std::cout << "7 * 7 = " << tree[7] << std::endl;
+
+    for (auto [ key, value ] : tree.entries) {
+        std::cout << key << " : " << value << std::endl;
+        value = value * 2;
+    }
+
+    for (const auto key : tree.keys) {
+        std::cout << key << " : " << tree[key] << std::endl;
+    }
+
+    [[maybe_unused]] bool rebalancing = check_rebalancing();
+    assert(rebalancing);
+
+    return 0;
+}
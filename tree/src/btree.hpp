@@ -0,0 +1,715 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "transparent.hpp"
+
+// B+ tree with the same interface as TreeMap. Entries live only in the leaves, which are
+// chained for iteration; inner nodes hold separators. Node capacities are derived from
+// `NodeBytes` so a node spans a few cache lines and a lookup touches ~log_B(n) of them.
+// K and V must be default constructible, as nodes keep them in fixed-size arrays.
+// Unlike TreeMap, entries move: an insert or remove shifts the leaf arrays and may split or
+// merge leaves, so it invalidates every iterator and every reference returned by `operator[]`,
+// `get_or_insert` or `find`.
+template <
+    typename K,
+    typename V,
+    typename Compare = std::compare_three_way,
+    size_t NodeBytes = 256
+>
+struct BTreeMap {
+private:
+    static constexpr size_t CACHE_LINE = 64;
+
+    // One slot above capacity lets a node overflow briefly before it is split.
+    static constexpr size_t LEAF_CAPACITY = std::max<size_t>(4, NodeBytes / (sizeof(K) + sizeof(V)));
+    static constexpr size_t INNER_CAPACITY = std::max<size_t>(4, NodeBytes / (sizeof(K) + sizeof(void*)));
+    static constexpr size_t LEAF_MIN = LEAF_CAPACITY / 2;
+    static constexpr size_t INNER_MIN = INNER_CAPACITY / 2;
+
+    struct alignas(CACHE_LINE) Leaf {
+        size_t      count;
+        Leaf*       prev;
+        Leaf*       next;
+        K           keys[LEAF_CAPACITY + 1];
+        V           values[LEAF_CAPACITY + 1];
+
+        Leaf() :
+            count(0),
+            prev(nullptr),
+            next(nullptr) {}
+    };
+
+    // Child i holds the keys below keys[i], child i + 1 those from keys[i] on.
+    struct alignas(CACHE_LINE) Inner {
+        size_t      count;
+        K           keys[INNER_CAPACITY + 1];
+        void*       children[INNER_CAPACITY + 2];
+
+        Inner() :
+            count(0) {}
+    };
+
+    // Nodes on the way from the root to a leaf, with the child index taken at each.
+    struct Path {
+        static constexpr size_t MAX_HEIGHT = 64;
+
+        Inner*  nodes[MAX_HEIGHT];
+        size_t  indices[MAX_HEIGHT];
+        size_t  depth = 0;
+
+        void push(Inner* node, size_t index) {
+            nodes[depth] = node;
+            indices[depth] = index;
+            ++ depth;
+        }
+    };
+
+    void* root;
+    size_t height; // Number of inner levels above the leaves
+    size_t _size;
+    [[no_unique_address]] Compare compare;
+
+    // First slot whose key is not less than `key`.
+    template<typename Q>
+    size_t _lower_index(const K* keys, size_t count, const Q& key) const {
+        size_t lo = 0;
+        while (count > 0) {
+            size_t half = count / 2;
+            bool less = compare(keys[lo + half], key) < 0;
+            lo = less ? lo + half + 1 : lo;
+            count = less ? count - half - 1 : half;
+        }
+        return lo;
+    }
+
+    // First slot whose key is greater than `key`.
+    template<typename Q>
+    size_t _upper_index(const K* keys, size_t count, const Q& key) const {
+        size_t lo = 0;
+        while (count > 0) {
+            size_t half = count / 2;
+            bool not_greater = compare(key, keys[lo + half]) >= 0;
+            lo = not_greater ? lo + half + 1 : lo;
+            count = not_greater ? count - half - 1 : half;
+        }
+        return lo;
+    }
+
+    template<typename Q>
+    Leaf* _descend(const Q& key, Path* path) const {
+        void* node = root;
+        for (size_t level = 0; level < height; ++ level) {
+            Inner* inner = static_cast<Inner*>(node);
+            size_t index = _upper_index(inner->keys, inner->count, key);
+            if (path) path->push(inner, index);
+            node = inner->children[index];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    template<typename Q>
+    std::pair<Leaf*, size_t> _find(const Q& key) const {
+        if (! root)
+            return { nullptr, 0 };
+        Leaf* leaf = _descend(key, nullptr);
+        size_t index = _lower_index(leaf->keys, leaf->count, key);
+        if (index < leaf->count && compare(key, leaf->keys[index]) == 0)
+            return { leaf, index };
+        return { nullptr, 0 };
+    }
+
+    Leaf* _first_leaf() const {
+        void* node = root;
+        for (size_t level = 0; level < height; ++ level)
+            node = static_cast<Inner*>(node)->children[0];
+        return static_cast<Leaf*>(node);
+    }
+
+    Leaf* _last_leaf() const {
+        void* node = root;
+        for (size_t level = 0; level < height; ++ level) {
+            Inner* inner = static_cast<Inner*>(node);
+            node = inner->children[inner->count];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    void _destroy(void* node, size_t level) {
+        if (level == 0) {
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        for (size_t i = 0; i <= inner->count; ++ i)
+            _destroy(inner->children[i], level - 1);
+        delete inner;
+    }
+
+    // Shifts slots [from, count) of parallel arrays one step right or left.
+    template<typename T>
+    static void _shift_right(T* items, size_t from, size_t count) {
+        std::move_backward(items + from, items + count, items + count + 1);
+    }
+    template<typename T>
+    static void _shift_left(T* items, size_t from, size_t count) {
+        std::move(items + from + 1, items + count, items + from);
+    }
+
+    // Hands `separator` and the new right sibling of path level `depth`'s child up the tree.
+    void _insert_separator(Path& path, size_t depth, K separator, void* right) {
+        if (depth == 0) {
+            Inner* grown = new Inner();
+            grown->count = 1;
+            grown->keys[0] = std::move(separator);
+            grown->children[0] = root;
+            grown->children[1] = right;
+            root = grown;
+            ++ height;
+            return;
+        }
+
+        Inner* inner = path.nodes[depth - 1];
+        size_t index = path.indices[depth - 1];
+        _shift_right(inner->keys, index, inner->count);
+        _shift_right(inner->children, index + 1, inner->count + 1);
+        inner->keys[index] = std::move(separator);
+        inner->children[index + 1] = right;
+        ++ inner->count;
+        if (inner->count <= INNER_CAPACITY)
+            return;
+
+        // Split: the middle key moves up, the upper half goes to a new node
+        size_t mid = inner->count / 2;
+        Inner* sibling = new Inner();
+        sibling->count = inner->count - mid - 1;
+        std::move(inner->keys + mid + 1, inner->keys + inner->count, sibling->keys);
+        std::copy(inner->children + mid + 1, inner->children + inner->count + 1, sibling->children);
+        inner->count = mid;
+        _insert_separator(path, depth - 1, std::move(inner->keys[mid]), sibling);
+    }
+
+    template<typename F>
+    V& _get_or_insert(const K& key, F&& make_value) {
+        if (! root)
+            root = new Leaf();
+
+        Path path;
+        Leaf* leaf = _descend(key, &path);
+        size_t index = _lower_index(leaf->keys, leaf->count, key);
+        if (index < leaf->count && compare(key, leaf->keys[index]) == 0)
+            return leaf->values[index];
+
+        V value = std::forward<F>(make_value)();
+        _shift_right(leaf->keys, index, leaf->count);
+        _shift_right(leaf->values, index, leaf->count);
+        leaf->keys[index] = key;
+        leaf->values[index] = std::move(value);
+        ++ leaf->count;
+        ++ _size;
+        if (leaf->count <= LEAF_CAPACITY)
+            return leaf->values[index];
+
+        // Split the leaf in halves and chain the new right half in
+        size_t mid = leaf->count / 2;
+        Leaf* sibling = new Leaf();
+        sibling->count = leaf->count - mid;
+        std::move(leaf->keys + mid, leaf->keys + leaf->count, sibling->keys);
+        std::move(leaf->values + mid, leaf->values + leaf->count, sibling->values);
+        leaf->count = mid;
+        sibling->prev = leaf;
+        sibling->next = leaf->next;
+        if (leaf->next) leaf->next->prev = sibling;
+        leaf->next = sibling;
+
+        V& inserted = index < mid ? leaf->values[index] : sibling->values[index - mid];
+        _insert_separator(path, path.depth, sibling->keys[0], sibling);
+        return inserted;
+    }
+
+    // Fixes an underfull leaf by borrowing from or merging with a sibling under the same parent.
+    void _rebalance_leaf(Path& path, Leaf* leaf) {
+        Inner* parent = path.nodes[path.depth - 1];
+        size_t index = path.indices[path.depth - 1];
+
+        if (index > 0) {
+            Leaf* left = static_cast<Leaf*>(parent->children[index - 1]);
+            if (left->count > LEAF_MIN) {
+                _shift_right(leaf->keys, 0, leaf->count);
+                _shift_right(leaf->values, 0, leaf->count);
+                leaf->keys[0] = std::move(left->keys[left->count - 1]);
+                leaf->values[0] = std::move(left->values[left->count - 1]);
+                -- left->count;
+                ++ leaf->count;
+                parent->keys[index - 1] = leaf->keys[0];
+                return;
+            }
+            _merge_leaves(path, left, leaf, index - 1);
+            return;
+        }
+
+        Leaf* right = static_cast<Leaf*>(parent->children[index + 1]);
+        if (right->count > LEAF_MIN) {
+            leaf->keys[leaf->count] = std::move(right->keys[0]);
+            leaf->values[leaf->count] = std::move(right->values[0]);
+            ++ leaf->count;
+            _shift_left(right->keys, 0, right->count);
+            _shift_left(right->values, 0, right->count);
+            -- right->count;
+            parent->keys[index] = right->keys[0];
+            return;
+        }
+        _merge_leaves(path, leaf, right, index);
+    }
+
+    // Appends `right` to `left`, dropping parent separator `separator` and the right child.
+    void _merge_leaves(Path& path, Leaf* left, Leaf* right, size_t separator) {
+        std::move(right->keys, right->keys + right->count, left->keys + left->count);
+        std::move(right->values, right->values + right->count, left->values + left->count);
+        left->count += right->count;
+        left->next = right->next;
+        if (right->next) right->next->prev = left;
+        delete right;
+        _remove_separator(path, path.depth - 1, separator);
+    }
+
+    void _remove_separator(Path& path, size_t depth, size_t separator) {
+        Inner* inner = path.nodes[depth];
+        _shift_left(inner->keys, separator, inner->count);
+        _shift_left(inner->children, separator + 1, inner->count + 1);
+        -- inner->count;
+
+        if (depth == 0) {
+            // The root may run down to a single child, which then takes its place
+            if (inner->count == 0) {
+                root = inner->children[0];
+                -- height;
+                delete inner;
+            }
+            return;
+        }
+        if (inner->count >= INNER_MIN)
+            return;
+
+        Inner* parent = path.nodes[depth - 1];
+        size_t index = path.indices[depth - 1];
+
+        if (index > 0) {
+            Inner* left = static_cast<Inner*>(parent->children[index - 1]);
+            if (left->count > INNER_MIN) {
+                // Rotate right through the parent separator
+                _shift_right(inner->keys, 0, inner->count);
+                _shift_right(inner->children, 0, inner->count + 1);
+                inner->keys[0] = std::move(parent->keys[index - 1]);
+                inner->children[0] = left->children[left->count];
+                parent->keys[index - 1] = std::move(left->keys[left->count - 1]);
+                -- left->count;
+                ++ inner->count;
+                return;
+            }
+            _merge_inners(path, depth, left, inner, index - 1);
+            return;
+        }
+
+        Inner* right = static_cast<Inner*>(parent->children[index + 1]);
+        if (right->count > INNER_MIN) {
+            // Rotate left through the parent separator
+            inner->keys[inner->count] = std::move(parent->keys[index]);
+            inner->children[inner->count + 1] = right->children[0];
+            ++ inner->count;
+            parent->keys[index] = std::move(right->keys[0]);
+            _shift_left(right->keys, 0, right->count);
+            _shift_left(right->children, 0, right->count + 1);
+            -- right->count;
+            return;
+        }
+        _merge_inners(path, depth, inner, right, index);
+    }
+
+    void _merge_inners(Path& path, size_t depth, Inner* left, Inner* right, size_t separator) {
+        Inner* parent = path.nodes[depth - 1];
+        left->keys[left->count] = std::move(parent->keys[separator]);
+        std::move(right->keys, right->keys + right->count, left->keys + left->count + 1);
+        std::copy(right->children, right->children + right->count + 1, left->children + left->count + 1);
+        left->count += right->count + 1;
+        delete right;
+        _remove_separator(path, depth - 1, separator);
+    }
+
+    template<typename Q>
+    bool _remove(const Q& key) {
+        if (! root)
+            return false;
+
+        Path path;
+        Leaf* leaf = _descend(key, &path);
+        size_t index = _lower_index(leaf->keys, leaf->count, key);
+        if (index == leaf->count || compare(key, leaf->keys[index]) != 0)
+            return false;
+
+        _shift_left(leaf->keys, index, leaf->count);
+        _shift_left(leaf->values, index, leaf->count);
+        -- leaf->count;
+        -- _size;
+
+        if (height == 0) {
+            if (leaf->count == 0) {
+                delete leaf;
+                root = nullptr;
+            }
+            return true;
+        }
+        if (leaf->count < LEAF_MIN)
+            _rebalance_leaf(path, leaf);
+        return true;
+    }
+
+    void _print_node(std::ostream& out, void* node, size_t level, int depth) const {
+        for (int i = 0; i < depth; ++ i) out << "    ";
+        if (level == 0) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            for (size_t i = 0; i < leaf->count; ++ i)
+                out << (i ? " " : "") << leaf->keys[i];
+            out << std::endl;
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        out << "\x1B[30m";
+        for (size_t i = 0; i < inner->count; ++ i)
+            out << (i ? " " : "") << inner->keys[i];
+        out << "\x1B[0m" << std::endl;
+        for (size_t i = 0; i <= inner->count; ++ i)
+            _print_node(out, inner->children[i], level - 1, depth + 1);
+    }
+
+public:
+    BTreeMap() :
+        root(nullptr),
+        height(0),
+        _size(0) {}
+
+    explicit BTreeMap(Compare compare) :
+        root(nullptr),
+        height(0),
+        _size(0),
+        compare(std::move(compare)) {}
+
+    BTreeMap(const BTreeMap&) = delete;
+    BTreeMap& operator=(const BTreeMap&) = delete;
+
+    BTreeMap(BTreeMap&& that) noexcept :
+        root(std::exchange(that.root, nullptr)),
+        height(std::exchange(that.height, 0)),
+        _size(std::exchange(that._size, 0)),
+        compare(std::move(that.compare)) {}
+
+    BTreeMap& operator=(BTreeMap&& that) noexcept {
+        std::swap(root, that.root);
+        std::swap(height, that.height);
+        std::swap(_size, that._size);
+        std::swap(compare, that.compare);
+        return *this;
+    }
+
+    ~BTreeMap() {
+        if (root) _destroy(root, height);
+    }
+
+    const size_t& size = _size;
+
+    inline bool empty() const {
+        return _size == 0;
+    }
+
+    V* find(const K& key) {
+        auto [ leaf, index ] = _find(key);
+        return leaf ? &leaf->values[index] : nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    V* find(const Q& key) {
+        auto [ leaf, index ] = _find(key);
+        return leaf ? &leaf->values[index] : nullptr;
+    }
+
+    const V* find(const K& key) const {
+        auto [ leaf, index ] = _find(key);
+        return leaf ? &leaf->values[index] : nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V* find(const Q& key) const {
+        auto [ leaf, index ] = _find(key);
+        return leaf ? &leaf->values[index] : nullptr;
+    }
+
+    bool contains(const K& key) const {
+        return find(key) != nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return find(key) != nullptr;
+    }
+
+    template<typename F>
+    const V& get_or(const K& key, F&& on_not_found) const {
+        if (const V* value = find(key))
+            return *value;
+        return std::forward<F>(on_not_found)();
+    }
+
+    const V& get(const K& key) const {
+        return get_or(key, [&key] -> const V& {
+            throw std::out_of_range(std::format("Key '{}' not found", key));
+        });
+    }
+
+    const V& get_or_else(const K& key, const V& def) const {
+        return get_or(key, [&def] -> const V& {
+            return def;
+        });
+    }
+
+    template<typename F>
+    V& get_or_insert(const K& key, F&& func) {
+        return _get_or_insert(key, std::forward<F>(func));
+    }
+
+    V& set(const K& key, const V& value) {
+        if (V* existing = find(key))
+            return *existing = value;
+        return get_or_insert(key, [&value] {
+            return value;
+        });
+    }
+
+    template<typename F>
+    bool update(const K& key, F&& func) {
+        V* value = find(key);
+        if (! value)
+            return false;
+        std::forward<F>(func)(*value);
+        return true;
+    }
+
+    const V& operator[](const K& key) const {
+        return get(key);
+    }
+
+    V& operator[](const K& key) {
+        return get_or_insert(key, [] {
+            return V();
+        });
+    }
+
+    bool remove(const K& key) {
+        return _remove(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool remove(const Q& key) {
+        return _remove(key);
+    }
+
+    void print(std::ostream &out = std::cout) const {
+        if (root) _print_node(out, root, height, 0);
+    }
+
+    // Iterators are a leaf and a slot, walking the leaf chain.
+    template<typename VI, typename Derefer>
+    struct IteratorBase {
+    private:
+        Leaf* leaf;
+        size_t index;
+        const BTreeMap* tree;
+        [[no_unique_address]] std::remove_const_t<Derefer> deref {};
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::remove_cvref_t<VI>;
+        using difference_type = std::ptrdiff_t;
+        using reference = VI;
+
+        IteratorBase() :
+            leaf(nullptr),
+            index(0),
+            tree(nullptr) {}
+
+        IteratorBase(Leaf* leaf, size_t index, const BTreeMap* tree) :
+            leaf(leaf),
+            index(index),
+            tree(tree) {}
+
+        IteratorBase& operator++() {
+            if (++ index == leaf->count) {
+                leaf = leaf->next;
+                index = 0;
+            }
+            return *this;
+        }
+        IteratorBase operator++(int) {
+            IteratorBase old = *this;
+            ++ *this;
+            return old;
+        }
+
+        IteratorBase& operator--() {
+            if (! leaf) {
+                leaf = tree->_last_leaf();
+                index = leaf->count;
+            }
+            else if (index == 0) {
+                leaf = leaf->prev;
+                index = leaf->count;
+            }
+            -- index;
+            return *this;
+        }
+        IteratorBase operator--(int) {
+            IteratorBase old = *this;
+            -- *this;
+            return old;
+        }
+
+        VI operator*() const {
+            return deref(leaf, index);
+        }
+
+        operator bool() const {
+            return leaf != nullptr;
+        }
+
+        bool operator==(const IteratorBase& that) const {
+            return leaf == that.leaf && index == that.index;
+        }
+    };
+
+    static constexpr auto ValueDerefer = [](Leaf* leaf, size_t index) -> V& {
+        return leaf->values[index];
+    };
+    using Iterator = IteratorBase<V&, decltype(ValueDerefer)>;
+    Iterator begin() {
+        if (empty()) return end();
+        return { _first_leaf(), 0, this };
+    }
+    inline Iterator end() const {
+        return { nullptr, 0, this };
+    }
+
+    static constexpr auto ConstValueDerefer = [](Leaf* leaf, size_t index) -> const V& {
+        return leaf->values[index];
+    };
+    using ConstIterator = IteratorBase<const V&, decltype(ConstValueDerefer)>;
+    ConstIterator cbegin() const {
+        if (empty()) return cend();
+        return { _first_leaf(), 0, this };
+    }
+    inline ConstIterator cend() const {
+        return { nullptr, 0, this };
+    }
+
+    using Entry = std::pair<const K&, V&>;
+    static constexpr auto EntryDerefer = [](Leaf* leaf, size_t index) -> Entry {
+        return { leaf->keys[index], leaf->values[index] };
+    };
+    using EntryIterator = IteratorBase<Entry, decltype(EntryDerefer)>;
+    EntryIterator entry_begin() {
+        if (empty()) return entry_end();
+        return { _first_leaf(), 0, this };
+    }
+    inline EntryIterator entry_end() const {
+        return { nullptr, 0, this };
+    }
+
+    using ConstEntry = std::pair<const K&, const V&>;
+    static constexpr auto ConstEntryDerefer = [](Leaf* leaf, size_t index) -> ConstEntry {
+        return { leaf->keys[index], leaf->values[index] };
+    };
+    using ConstEntryIterator = IteratorBase<ConstEntry, decltype(ConstEntryDerefer)>;
+    ConstEntryIterator entry_cbegin() const {
+        if (empty()) return entry_cend();
+        return { _first_leaf(), 0, this };
+    }
+    inline ConstEntryIterator entry_cend() const {
+        return { nullptr, 0, this };
+    }
+
+    struct Entries {
+        BTreeMap& tree;
+
+        Entries(BTreeMap& tree) : tree(tree) {}
+
+        EntryIterator begin() {
+            return tree.entry_begin();
+        }
+        EntryIterator end() const {
+            return tree.entry_end();
+        }
+        ConstEntryIterator cbegin() const {
+            return tree.entry_cbegin();
+        }
+        ConstEntryIterator cend() const {
+            return tree.entry_cend();
+        }
+    } entries { *this };
+
+    static constexpr auto KeyDerefer = [](Leaf* leaf, size_t index) -> const K& {
+        return leaf->keys[index];
+    };
+    using KeyIterator = IteratorBase<const K&, decltype(KeyDerefer)>;
+    KeyIterator key_begin() const {
+        if (empty()) return key_end();
+        return { _first_leaf(), 0, this };
+    }
+    inline KeyIterator key_end() const {
+        return { nullptr, 0, this };
+    }
+
+    struct Keys {
+        BTreeMap& tree;
+
+        Keys(BTreeMap& tree) : tree(tree) {}
+
+        KeyIterator begin() const {
+            return tree.key_begin();
+        }
+        KeyIterator end() const {
+            return tree.key_end();
+        }
+        KeyIterator cbegin() const {
+            return tree.key_begin();
+        }
+        KeyIterator cend() const {
+            return tree.key_end();
+        }
+    } keys { *this };
+
+    // First entry whose key is not less than `key`, found in one descent.
+    EntryIterator lower_bound(const K& key) {
+        if (! root)
+            return entry_end();
+        Leaf* leaf = _descend(key, nullptr);
+        size_t index = _lower_index(leaf->keys, leaf->count, key);
+        if (index == leaf->count) {
+            leaf = leaf->next;
+            index = 0;
+        }
+        return { leaf, index, this };
+    }
+};
+
+template <typename K, typename V, typename Compare, size_t NodeBytes>
+std::ostream& operator<<(std::ostream& out, const BTreeMap<K, V, Compare, NodeBytes>& tree) {
+    tree.print(out);
+    return out;
+}
@@ -0,0 +1,27 @@
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include "flatmap.hpp"
+
+int main() {
+    std::vector<std::pair<int, int>> batch = {
+        { 1, 1 }, { 2, 4 }, { 3, 9 }, { 4, 16 }, { 8, 64 }, { 7, 49 }, { 6, 36 }, { 5, 25 }
+    };
+    FlatTreeMap<int, int> map(batch.begin(), batch.end());
+
+    map.remove(8);
+    map.print();
+
+    std::cout << "7 * 7 = " << map[7] << std::endl;
+
+    for (auto [ key, value ] : map.entries) {
+        value = value * 2;
+    }
+
+    for (const auto key : map.keys) {
+        std::cout << key << " : " << map[key] << std::endl;
+    }
+
+    return 0;
+}
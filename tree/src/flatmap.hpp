@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "transparent.hpp"
+
+// Sorted map over two parallel arrays, for tables that are built once and then mostly read.
+// Lookups are a branchless binary search over the keys alone; single inserts and removals
+// shift the arrays, so bulk loading should go through `insert_batch`.
+template <
+    typename K,
+    typename V,
+    typename Compare = std::compare_three_way
+>
+struct FlatTreeMap {
+private:
+    std::vector<K> key_store;
+    std::vector<V> value_store;
+    size_t _size;
+    [[no_unique_address]] Compare compare;
+
+    // First slot whose key is not less than `key`. The loop has no data-dependent branch:
+    // the comparison only selects the next base, which compiles to a conditional move.
+    template<typename Q>
+    size_t _lower_index(const Q& key) const {
+        size_t count = key_store.size();
+        if (count == 0)
+            return 0;
+        const K* base = key_store.data();
+        while (count > 1) {
+            size_t half = count / 2;
+            base = compare(base[half - 1], key) < 0 ? base + half : base;
+            count -= half;
+        }
+        return (base - key_store.data()) + (compare(*base, key) < 0);
+    }
+
+    template<typename Q>
+    const V* _find(const Q& key) const {
+        size_t index = _lower_index(key);
+        if (index < _size && compare(key, key_store[index]) == 0)
+            return &value_store[index];
+        return nullptr;
+    }
+
+    template<typename Q>
+    bool _remove(const Q& key) {
+        size_t index = _lower_index(key);
+        if (index == _size || compare(key, key_store[index]) != 0)
+            return false;
+        key_store.erase(key_store.begin() + index);
+        value_store.erase(value_store.begin() + index);
+        -- _size;
+        return true;
+    }
+
+public:
+    FlatTreeMap() :
+        _size(0) {}
+
+    explicit FlatTreeMap(Compare compare) :
+        _size(0),
+        compare(std::move(compare)) {}
+
+    template<typename InputIt>
+    FlatTreeMap(InputIt first, InputIt last, Compare compare = Compare()) :
+        _size(0),
+        compare(std::move(compare)) {
+        insert_batch(first, last);
+    }
+
+    FlatTreeMap(const FlatTreeMap&) = delete;
+    FlatTreeMap& operator=(const FlatTreeMap&) = delete;
+
+    FlatTreeMap(FlatTreeMap&& that) noexcept :
+        key_store(std::move(that.key_store)),
+        value_store(std::move(that.value_store)),
+        _size(std::exchange(that._size, 0)),
+        compare(std::move(that.compare)) {}
+
+    FlatTreeMap& operator=(FlatTreeMap&& that) noexcept {
+        std::swap(key_store, that.key_store);
+        std::swap(value_store, that.value_store);
+        std::swap(_size, that._size);
+        std::swap(compare, that.compare);
+        return *this;
+    }
+
+    const size_t& size = _size;
+
+    inline bool empty() const {
+        return _size == 0;
+    }
+
+    void reserve(size_t count) {
+        key_store.reserve(count);
+        value_store.reserve(count);
+    }
+
+    void shrink_to_fit() {
+        key_store.shrink_to_fit();
+        value_store.shrink_to_fit();
+    }
+
+    V* find(const K& key) {
+        return const_cast<V*>(_find(key));
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    V* find(const Q& key) {
+        return const_cast<V*>(_find(key));
+    }
+
+    const V* find(const K& key) const {
+        return _find(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V* find(const Q& key) const {
+        return _find(key);
+    }
+
+    bool contains(const K& key) const {
+        return _find(key) != nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return _find(key) != nullptr;
+    }
+
+    template<typename F>
+    const V& get_or(const K& key, F&& on_not_found) const {
+        if (const V* value = _find(key))
+            return *value;
+        return std::forward<F>(on_not_found)();
+    }
+
+    const V& get(const K& key) const {
+        return get_or(key, [&key] -> const V& {
+            throw std::out_of_range(std::format("Key '{}' not found", key));
+        });
+    }
+
+    const V& get_or_else(const K& key, const V& def) const {
+        return get_or(key, [&def] -> const V& {
+            return def;
+        });
+    }
+
+    // Single insert, O(n) for the shift. Prefer `insert_batch` for more than a few keys.
+    V& set(const K& key, const V& value) {
+        size_t index = _lower_index(key);
+        if (index < _size && compare(key, key_store[index]) == 0)
+            return value_store[index] = value;
+        key_store.insert(key_store.begin() + index, key);
+        value_store.insert(value_store.begin() + index, value);
+        ++ _size;
+        return value_store[index];
+    }
+
+    template<typename F>
+    bool update(const K& key, F&& func) {
+        V* value = find(key);
+        if (! value)
+            return false;
+        std::forward<F>(func)(*value);
+        return true;
+    }
+
+    const V& operator[](const K& key) const {
+        return get(key);
+    }
+
+    V& operator[](const K& key) {
+        if (V* value = find(key))
+            return *value;
+        return set(key, V());
+    }
+
+    bool remove(const K& key) {
+        return _remove(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool remove(const Q& key) {
+        return _remove(key);
+    }
+
+    // Inserts key-value pairs from [first, last) in O(n + m log m): the batch is sorted,
+    // then merged with the current contents in one pass. Later duplicates in the batch and
+    // batch entries for existing keys win, as with repeated `set`.
+    template<typename InputIt>
+    void insert_batch(InputIt first, InputIt last) {
+        std::vector<std::pair<K, V>> batch;
+        for (; first != last; ++ first) {
+            const auto& [ key, value ] = *first;
+            batch.emplace_back(key, value);
+        }
+        if (batch.empty())
+            return;
+
+        std::stable_sort(batch.begin(), batch.end(), [this](const auto& a, const auto& b) {
+            return compare(a.first, b.first) < 0;
+        });
+
+        std::vector<K> merged_keys;
+        std::vector<V> merged_values;
+        merged_keys.reserve(_size + batch.size());
+        merged_values.reserve(_size + batch.size());
+
+        size_t i = 0;
+        for (size_t j = 0; j < batch.size(); ++ j) {
+            // Only the last of a run of equal batch keys is kept
+            if (j + 1 < batch.size() && compare(batch[j].first, batch[j + 1].first) == 0)
+                continue;
+            auto& [ key, value ] = batch[j];
+            for (; i < _size && compare(key_store[i], key) < 0; ++ i) {
+                merged_keys.push_back(std::move(key_store[i]));
+                merged_values.push_back(std::move(value_store[i]));
+            }
+            if (i < _size && compare(key_store[i], key) == 0)
+                ++ i;
+            merged_keys.push_back(std::move(key));
+            merged_values.push_back(std::move(value));
+        }
+        for (; i < _size; ++ i) {
+            merged_keys.push_back(std::move(key_store[i]));
+            merged_values.push_back(std::move(value_store[i]));
+        }
+
+        key_store = std::move(merged_keys);
+        value_store = std::move(merged_values);
+        _size = key_store.size();
+    }
+
+    void print(std::ostream &out = std::cout) const {
+        for (size_t i = 0; i < _size; ++ i)
+            out << key_store[i] << " : " << value_store[i] << std::endl;
+    }
+
+    // Iterators are a slot index into both arrays.
+    template<typename VI, typename Derefer>
+    struct IteratorBase {
+    private:
+        size_t index;
+        const FlatTreeMap* map;
+        [[no_unique_address]] std::remove_const_t<Derefer> deref {};
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::remove_cvref_t<VI>;
+        using difference_type = std::ptrdiff_t;
+        using reference = VI;
+
+        IteratorBase() :
+            index(0),
+            map(nullptr) {}
+
+        IteratorBase(size_t index, const FlatTreeMap* map) :
+            index(index),
+            map(map) {}
+
+        IteratorBase& operator++() {
+            ++ index;
+            return *this;
+        }
+        IteratorBase operator++(int) {
+            IteratorBase old = *this;
+            ++ index;
+            return old;
+        }
+
+        IteratorBase& operator--() {
+            -- index;
+            return *this;
+        }
+        IteratorBase operator--(int) {
+            IteratorBase old = *this;
+            -- index;
+            return old;
+        }
+
+        VI operator*() const {
+            return deref(map, index);
+        }
+
+        operator bool() const {
+            return index < map->_size;
+        }
+
+        bool operator==(const IteratorBase& that) const {
+            return index == that.index;
+        }
+    };
+
+    static constexpr auto ValueDerefer = [](const FlatTreeMap* map, size_t index) -> V& {
+        return const_cast<FlatTreeMap*>(map)->value_store[index];
+    };
+    using Iterator = IteratorBase<V&, decltype(ValueDerefer)>;
+    Iterator begin() {
+        return { 0, this };
+    }
+    inline Iterator end() const {
+        return { _size, this };
+    }
+
+    static constexpr auto ConstValueDerefer = [](const FlatTreeMap* map, size_t index) -> const V& {
+        return map->value_store[index];
+    };
+    using ConstIterator = IteratorBase<const V&, decltype(ConstValueDerefer)>;
+    ConstIterator cbegin() const {
+        return { 0, this };
+    }
+    inline ConstIterator cend() const {
+        return { _size, this };
+    }
+
+    using Entry = std::pair<const K&, V&>;
+    static constexpr auto EntryDerefer = [](const FlatTreeMap* map, size_t index) -> Entry {
+        return { map->key_store[index], const_cast<FlatTreeMap*>(map)->value_store[index] };
+    };
+    using EntryIterator = IteratorBase<Entry, decltype(EntryDerefer)>;
+    EntryIterator entry_begin() {
+        return { 0, this };
+    }
+    inline EntryIterator entry_end() const {
+        return { _size, this };
+    }
+
+    using ConstEntry = std::pair<const K&, const V&>;
+    static constexpr auto ConstEntryDerefer = [](const FlatTreeMap* map, size_t index) -> ConstEntry {
+        return { map->key_store[index], map->value_store[index] };
+    };
+    using ConstEntryIterator = IteratorBase<ConstEntry, decltype(ConstEntryDerefer)>;
+    ConstEntryIterator entry_cbegin() const {
+        return { 0, this };
+    }
+    inline ConstEntryIterator entry_cend() const {
+        return { _size, this };
+    }
+
+    struct Entries {
+        FlatTreeMap& map;
+
+        Entries(FlatTreeMap& map) : map(map) {}
+
+        EntryIterator begin() {
+            return map.entry_begin();
+        }
+        EntryIterator end() const {
+            return map.entry_end();
+        }
+        ConstEntryIterator cbegin() const {
+            return map.entry_cbegin();
+        }
+        ConstEntryIterator cend() const {
+            return map.entry_cend();
+        }
+    } entries { *this };
+
+    static constexpr auto KeyDerefer = [](const FlatTreeMap* map, size_t index) -> const K& {
+        return map->key_store[index];
+    };
+    using KeyIterator = IteratorBase<const K&, decltype(KeyDerefer)>;
+    KeyIterator key_begin() const {
+        return { 0, this };
+    }
+    inline KeyIterator key_end() const {
+        return { _size, this };
+    }
+
+    struct Keys {
+        FlatTreeMap& map;
+
+        Keys(FlatTreeMap& map) : map(map) {}
+
+        KeyIterator begin() const {
+            return map.key_begin();
+        }
+        KeyIterator end() const {
+            return map.key_end();
+        }
+        KeyIterator cbegin() const {
+            return map.key_begin();
+        }
+        KeyIterator cend() const {
+            return map.key_end();
+        }
+    } keys { *this };
+
+    EntryIterator lower_bound(const K& key) {
+        return { _lower_index(key), this };
+    }
+};
+
+template <typename K, typename V, typename Compare>
+std::ostream& operator<<(std::ostream& out, const FlatTreeMap<K, V, Compare>& map) {
+    map.print(out);
+    return out;
+}
@@ -0,0 +1,3251 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <compare>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <ostream>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <format>
+
+#include "transparent.hpp"
+
+enum class Direction : short {
+    ROOT = 0,
+    LEFT = -1,
+    RIGHT = 1,
+};
+
+inline Direction operator-(Direction dir) {
+    return static_cast<Direction>(- static_cast<short>(dir));
+}
+
+// Node pools decide where TreeMap nodes live.
+// `HeapNodes` allocates every node on its own, `ArenaNodes` carves them out of slabs.
+struct HeapNodes {
+    template <typename Node>
+    struct Pool {
+        static constexpr bool bulk_release = false;
+
+        template <typename... Args>
+        Node* create(Args&&... args) {
+            return new Node(std::forward<Args>(args)...);
+        }
+
+        void destroy(Node* node) {
+            delete node;
+        }
+
+        void reserve(size_t) {}
+
+        void adopt(const Pool&) {}
+    };
+};
+
+template <typename Node>
+struct NodeArena {
+private:
+    union Slot {
+        Slot* next;
+        alignas(Node) std::byte storage[sizeof(Node)];
+    };
+
+    static constexpr size_t MIN_SLAB = 64;
+    static constexpr size_t MAX_SLAB = 1 << 16;
+
+    using SlabSet = std::vector<std::shared_ptr<Slot[]>>;
+
+    // Slabs are shared so that nodes can move to another tree's arena,
+    // see `adopt`; each arena still hands out and recycles slots on its own.
+    // The set itself is shared copy-on-write, so node handles and arenas of one lineage
+    // hold it by a single reference. It is kept sorted by address for `adopt`.
+    std::shared_ptr<SlabSet> slabs;
+    Slot* cursor;
+    Slot* limit;
+    Slot* free_list;
+    size_t next_slab;
+
+    SlabSet& _own_slabs() {
+        if (! slabs)
+            slabs = std::make_shared<SlabSet>();
+        else if (slabs.use_count() > 1)
+            slabs = std::make_shared<SlabSet>(*slabs);
+        return *slabs;
+    }
+
+    static Slot* _address(const std::shared_ptr<Slot[]>& slab) {
+        return slab.get();
+    }
+
+    void _grow(size_t count) {
+        SlabSet& owned = _own_slabs();
+        std::shared_ptr<Slot[]> slab(new Slot[count]);
+        Slot* first = slab.get();
+        owned.insert(std::ranges::upper_bound(owned, first, std::less<>(), _address), std::move(slab));
+        cursor = first;
+        limit = first + count;
+    }
+
+public:
+    NodeArena() :
+        cursor(nullptr),
+        limit(nullptr),
+        free_list(nullptr),
+        next_slab(MIN_SLAB) {}
+
+    NodeArena(NodeArena&& that) noexcept :
+        slabs(std::move(that.slabs)),
+        cursor(std::exchange(that.cursor, nullptr)),
+        limit(std::exchange(that.limit, nullptr)),
+        free_list(std::exchange(that.free_list, nullptr)),
+        next_slab(std::exchange(that.next_slab, MIN_SLAB)) {}
+
+    NodeArena& operator=(NodeArena&& that) noexcept {
+        std::swap(slabs, that.slabs);
+        std::swap(cursor, that.cursor);
+        std::swap(limit, that.limit);
+        std::swap(free_list, that.free_list);
+        std::swap(next_slab, that.next_slab);
+        return *this;
+    }
+
+    void* allocate() {
+        if (free_list)
+            return std::exchange(free_list, free_list->next);
+        if (cursor == limit) {
+            _grow(next_slab);
+            if (next_slab < MAX_SLAB) next_slab *= 2;
+        }
+        return cursor ++;
+    }
+
+    void deallocate(void* ptr) {
+        Slot* slot = static_cast<Slot*>(ptr);
+        slot->next = free_list;
+        free_list = slot;
+    }
+
+    // Keeps the slabs of `that` alive as long as this arena,
+    // so nodes carved out of them may be destroyed through this arena.
+    // Only slabs this arena lacks cost a merge; once two arenas hold the same slabs they share
+    // one set, so moving nodes back and forth between them allocates nothing.
+    void adopt(const NodeArena& that) {
+        if (! that.slabs || that.slabs == slabs)
+            return;
+        if (! slabs || std::ranges::includes(*that.slabs, *slabs, std::less<>(), _address, _address)) {
+            slabs = that.slabs;
+            return;
+        }
+        if (std::ranges::includes(*slabs, *that.slabs, std::less<>(), _address, _address))
+            return;
+        auto merged = std::make_shared<SlabSet>();
+        merged->reserve(slabs->size() + that.slabs->size());
+        std::ranges::set_union(*slabs, *that.slabs, std::back_inserter(*merged), std::less<>(), _address, _address);
+        slabs = std::move(merged);
+    }
+
+    // Makes sure the next `count` allocations need no further slab. They are not necessarily
+    // contiguous: `allocate` still hands out recycled slots first, including the unused tail
+    // of the current slab, which is moved to the free list when a new slab is needed.
+    void reserve(size_t count) {
+        if (static_cast<size_t>(limit - cursor) >= count)
+            return;
+        while (cursor != limit)
+            deallocate(cursor ++);
+        _grow(count);
+    }
+};
+
+struct ArenaNodes {
+    template <typename Node>
+    struct Pool {
+        // Slabs are freed all at once when the arena goes away,
+        // so trivially destructible nodes never need to be visited.
+        static constexpr bool bulk_release = true;
+
+        NodeArena<Node> arena;
+
+        template <typename... Args>
+        Node* create(Args&&... args) {
+            void* ptr = arena.allocate();
+            try {
+                return new (ptr) Node(std::forward<Args>(args)...);
+            }
+            catch (...) {
+                arena.deallocate(ptr);
+                throw;
+            }
+        }
+
+        void destroy(Node* node) {
+            node->~Node();
+            arena.deallocate(node);
+        }
+
+        void reserve(size_t count) {
+            arena.reserve(count);
+        }
+
+        void adopt(const Pool& that) {
+            arena.adopt(that.arena);
+        }
+    };
+};
+
+// Augmentations keep extra data in every node describing its whole subtree.
+// `pull` recomputes a node's data from its own entry and its children's data.
+struct NoAugment {
+    template <typename K, typename V>
+    struct Data {
+        void pull(const K&, const V&, const Data*, const Data*) {}
+    };
+};
+
+// Subtree sizes, enabling rank and select in O(log n).
+struct OrderStatistics {
+    template <typename K, typename V>
+    struct Data {
+        size_t size = 1;
+
+        void pull(const K&, const V&, const Data* left, const Data* right) {
+            size = 1 + (left ? left->size : 0) + (right ? right->size : 0);
+        }
+    };
+};
+
+// Subtree sizes plus a monoid folded over the entries of every subtree,
+// enabling aggregate(lo, hi) in O(log n).
+// TreeMap then hands values out read-only; they change through set, update or
+// insert_or_assign, which refresh the aggregates.
+template <typename M>
+struct Aggregate {
+    using Monoid = M;
+
+    template <typename K, typename V>
+    struct Data : OrderStatistics::Data<K, V> {
+        typename M::value_type total = M::identity();
+
+        void pull(const K& key, const V& value, const Data* left, const Data* right) {
+            OrderStatistics::Data<K, V>::pull(key, value, left, right);
+            total = M::combine(
+                M::combine(left ? left->total : M::identity(), M::lift(key, value)),
+                right ? right->total : M::identity()
+            );
+        }
+    };
+};
+
+template <typename T>
+struct Sum {
+    using value_type = T;
+
+    static T identity() {
+        return T();
+    }
+    static T lift(const auto&, const auto& value) {
+        return value;
+    }
+    static T combine(const T& a, const T& b) {
+        return a + b;
+    }
+};
+
+template <typename T>
+struct Min {
+    using value_type = T;
+
+    static T identity() {
+        return std::numeric_limits<T>::max();
+    }
+    static T lift(const auto&, const auto& value) {
+        return value;
+    }
+    static T combine(const T& a, const T& b) {
+        return std::min(a, b);
+    }
+};
+
+template <typename T>
+struct Max {
+    using value_type = T;
+
+    static T identity() {
+        return std::numeric_limits<T>::lowest();
+    }
+    static T lift(const auto&, const auto& value) {
+        return value;
+    }
+    static T combine(const T& a, const T& b) {
+        return std::max(a, b);
+    }
+};
+
+enum class Execution : bool {
+    SEQUENTIAL,
+    PARALLEL,
+};
+
+template <typename Augment>
+concept Aggregating = requires {
+    typename Augment::Monoid;
+};
+
+template <typename Data>
+concept SubtreeSized = requires(const Data& data) {
+    { data.size } -> std::convertible_to<size_t>;
+};
+
+// Define TREEMAP_STATS before including this header to have every TreeMap count the work
+// of its hot paths; `TreeMap::stats()` then returns a snapshot. Without it the counting
+// compiles to nothing.
+#ifdef TREEMAP_STATS
+#define TREEMAP_COUNT(counter) (_counters.counter.fetch_add(1, std::memory_order_relaxed))
+#else
+#define TREEMAP_COUNT(counter) ((void) 0)
+#endif
+
+// Insert fix-up cases are indexed 1, 2, 3, 4, 5.1, 5.2 and remove fix-up cases 0 to 5,
+// as numbered in `_maintain_after_insert` and `_maintain_after_remove`. Rotations and
+// recolorings are those made by inserts and removals; join-based bulk operations are
+// not counted. Depths are computed from the tree when the snapshot is taken.
+struct TreeMapStats {
+    static constexpr std::array<const char*, 6> INSERT_CASES = { "1", "2", "3", "4", "5.1", "5.2" };
+
+    uint64_t comparisons = 0;
+    uint64_t rotations_left = 0;
+    uint64_t rotations_right = 0;
+    uint64_t recolorings = 0;
+    std::array<uint64_t, 6> insert_cases {};
+    std::array<uint64_t, 6> remove_cases {};
+    uint64_t allocations = 0;
+    size_t max_depth = 0;
+    double average_depth = 0;
+
+    std::string to_json() const {
+        std::string json = "{";
+        auto field = [&json](const char* name, const std::string& value) {
+            if (json.size() > 1) json += ",";
+            json += "\"";
+            json += name;
+            json += "\":";
+            json += value;
+        };
+        auto cases = [](const std::array<uint64_t, 6>& counts, auto&& name_of) {
+            std::string object = "{";
+            for (size_t i = 0; i < counts.size(); ++ i) {
+                if (i) object += ",";
+                object += "\"";
+                object += name_of(i);
+                object += "\":" + std::to_string(counts[i]);
+            }
+            return object + "}";
+        };
+        field("comparisons", std::to_string(comparisons));
+        field("rotations_left", std::to_string(rotations_left));
+        field("rotations_right", std::to_string(rotations_right));
+        field("recolorings", std::to_string(recolorings));
+        field("insert_cases", cases(insert_cases, [](size_t i) {
+            return std::string(INSERT_CASES[i]);
+        }));
+        field("remove_cases", cases(remove_cases, [](size_t i) {
+            return std::to_string(i);
+        }));
+        field("allocations", std::to_string(allocations));
+        field("max_depth", std::to_string(max_depth));
+        field("average_depth", std::to_string(average_depth));
+        return json + "}";
+    }
+};
+
+#ifdef TREEMAP_STATS
+// Live counters behind `TreeMapStats`, atomic as parallel set operations compare from several threads.
+struct TreeMapCounters {
+    std::atomic<uint64_t> comparisons {};
+    std::atomic<uint64_t> rotations_left {};
+    std::atomic<uint64_t> rotations_right {};
+    std::atomic<uint64_t> recolorings {};
+    std::array<std::atomic<uint64_t>, 6> insert_cases {};
+    std::array<std::atomic<uint64_t>, 6> remove_cases {};
+    std::atomic<uint64_t> allocations {};
+};
+#endif
+
+template <typename K, typename V, typename Compare>
+struct FrozenTreeMap;
+
+template <
+    typename K,
+    typename V,
+    typename Compare = std::compare_three_way,
+    typename Nodes = HeapNodes,
+    typename Augment = NoAugment
+>
+struct TreeMap {
+private:
+    // The color lives in the low bit of the parent link, so RED must be 0.
+    enum class Color : bool {
+        RED = 0,
+        BLACK = 1,
+    };
+
+    static constexpr uintptr_t COLOR_MASK = 1;
+
+    using AugData = typename Augment::template Data<K, V>;
+    static constexpr bool augmented = ! std::is_empty_v<AugData>;
+
+    // What mutable accessors expose: a value written in place would leave aggregates stale.
+    using Value = std::conditional_t<Aggregating<Augment>, const V, V>;
+
+    struct Node {
+        using PNode = Node*;
+
+        PNode       left;
+        PNode       right;
+        uintptr_t   parent_color;
+        K           key;
+        V           value;
+        [[no_unique_address]] AugData aug;
+
+        // The key and value are built in place from the forwarded arguments.
+        template<typename KArg, typename... VArgs>
+        explicit Node(KArg&& key, VArgs&&... args) :
+            left(nullptr),
+            right(nullptr),
+            parent_color(static_cast<uintptr_t>(Color::RED)),
+            key(std::forward<KArg>(key)),
+            value(std::forward<VArgs>(args)...),
+            aug() {}
+
+        PNode parent() const {
+            return reinterpret_cast<PNode>(parent_color & ~ COLOR_MASK);
+        }
+        void set_parent(PNode parent) {
+            parent_color = reinterpret_cast<uintptr_t>(parent) | (parent_color & COLOR_MASK);
+        }
+
+        Color color() const {
+            return static_cast<Color>(parent_color & COLOR_MASK);
+        }
+        void set_color(Color color) {
+            parent_color = (parent_color & ~ COLOR_MASK) | static_cast<uintptr_t>(color);
+        }
+
+        bool is_red() const {
+            return color() == Color::RED;
+        }
+        bool is_black() const {
+            return color() == Color::BLACK;
+        }
+
+        bool is_leaf() const {
+            return ! left && ! right;
+        }
+
+        PNode only_child() const {
+            return left ? left : right;
+        }
+
+        Direction direction() const {
+            PNode parent = this->parent();
+            if (! parent)
+                return Direction::ROOT;
+            return this == parent->left
+                ? Direction::LEFT
+                : Direction::RIGHT;
+        }
+
+        PNode sibling() const {
+            PNode parent = this->parent();
+            return direction() == Direction::LEFT
+                ? parent->right
+                : parent->left;
+        }
+
+        PNode min() {
+            PNode node = this;
+            while (node->left)
+                node = node->left;
+            return node;
+        }
+        PNode max() {
+            PNode node = this;
+            while (node->right)
+                node = node->right;
+            return node;
+        }
+
+        PNode prev() const {
+            assert(left);
+            return left->max();
+        }
+        PNode next() const {
+            assert(right);
+            return right->min();
+        }
+    };
+
+    static_assert(alignof(Node) > COLOR_MASK, "Node alignment must leave room for the color bit");
+
+    using PNode = typename Node::PNode;
+    using Pool = typename Nodes::template Pool<Node>;
+
+    PNode root;
+    size_t _size;
+    [[no_unique_address]] Compare compare;
+    [[no_unique_address]] Pool pool;
+
+#ifdef TREEMAP_STATS
+    mutable TreeMapCounters _counters;
+
+    static void _depths(PNode node, size_t depth, size_t& max, size_t& total) {
+        if (! node) return;
+        max = std::max(max, depth);
+        total += depth;
+        _depths(node->left, depth + 1, max, total);
+        _depths(node->right, depth + 1, max, total);
+    }
+#endif
+
+    template<typename A, typename B>
+    auto _compare(const A& a, const B& b) const {
+        TREEMAP_COUNT(comparisons);
+        return compare(a, b);
+    }
+
+    template<typename... Args>
+    PNode _create(Args&&... args) {
+        TREEMAP_COUNT(allocations);
+        return pool.create(std::forward<Args>(args)...);
+    }
+
+    void _recolor(PNode node, Color color) {
+        TREEMAP_COUNT(recolorings);
+        node->set_color(color);
+    }
+
+    // Frees a subtree without recursion: a left child is rotated up until the top node has
+    // none, then that node goes and its right subtree is next, so no stack is needed.
+    size_t _destroy_subtree(PNode node) {
+        size_t count = 0;
+        while (node) {
+            if (PNode left = node->left) {
+                node->left = left->right;
+                left->right = node;
+                node = left;
+                continue;
+            }
+            PNode right = node->right;
+            pool.destroy(node);
+            node = right;
+            ++ count;
+        }
+        return count;
+    }
+
+    // Counts a detached subtree by walking its in-order successors, without recursion.
+    static size_t _count_subtree(PNode node) {
+        if constexpr (SubtreeSized<AugData>)
+            return _subtree_size(node);
+        else {
+            size_t count = 0;
+            if (! node)
+                return count;
+            for (PNode it = node->min(); it; it = _successor(it))
+                ++ count;
+            return count;
+        }
+    }
+
+    void _release() {
+        constexpr bool trivial = std::is_trivially_destructible_v<K> && std::is_trivially_destructible_v<V>;
+        if constexpr (! (Pool::bulk_release && trivial))
+            _destroy_subtree(root);
+        root = nullptr;
+        _size = 0;
+    }
+
+    // Builds a perfectly balanced subtree from the next `count` entries.
+    // Levels above `red_depth` are complete and black, the partial bottom level is red,
+    // so every path sees the same number of black nodes.
+    template<typename It>
+    PNode _build_sorted(It& it, size_t count, size_t depth, size_t red_depth, PNode& prev) {
+        if (count == 0)
+            return nullptr;
+
+        size_t left_count = (count - 1) / 2;
+        PNode left = _build_sorted(it, left_count, depth + 1, red_depth, prev);
+
+        const auto& [ key, value ] = *it;
+        ++ it;
+        PNode node = _create(key, value);
+        assert(! prev || compare(prev->key, node->key) < 0);
+        prev = node;
+
+        node->set_color(depth >= red_depth ? Color::RED : Color::BLACK);
+        node->left = left;
+        if (left) left->set_parent(node);
+        node->right = _build_sorted(it, count - 1 - left_count, depth + 1, red_depth, prev);
+        if (node->right) node->right->set_parent(node);
+        _pull(node);
+        return node;
+    }
+
+    void _replace_node(PNode old, PNode rep) {
+        switch (old->direction()) {
+            case Direction::LEFT:
+                old->parent()->left = rep;
+                break;
+            case Direction::RIGHT:
+                old->parent()->right = rep;
+                break;
+            case Direction::ROOT:
+                root = rep;
+                break;
+        }
+        if (rep) rep->set_parent(old->parent());
+    }
+
+    static void _pull(PNode node) {
+        if constexpr (augmented) {
+            node->aug.pull(
+                node->key, node->value,
+                node->left ? &node->left->aug : nullptr,
+                node->right ? &node->right->aug : nullptr
+            );
+        }
+    }
+
+    // Refreshes augmented data from `node` up to the root after its subtree changed.
+    static void _pull_path(PNode node) {
+        if constexpr (augmented) {
+            for (; node; node = node->parent())
+                _pull(node);
+        }
+    }
+
+    void _rotate_left(PNode node) {
+        TREEMAP_COUNT(rotations_left);
+        PNode rep = node->right;
+        _replace_node(node, rep);
+        node->set_parent(rep);
+        node->right = rep->left;
+        if (node->right) node->right->set_parent(node);
+        rep->left = node;
+        _pull(node);
+        _pull(rep);
+    }
+
+    void _rotate_right(PNode node) {
+        TREEMAP_COUNT(rotations_right);
+        PNode rep = node->left;
+        _replace_node(node, rep);
+        node->set_parent(rep);
+        node->left = rep->right;
+        if (node->left) node->left->set_parent(node);
+        rep->right = node;
+        _pull(node);
+        _pull(rep);
+    }
+
+    static PNode _successor(PNode node) {
+        if (node->right)
+            return node->right->min();
+        while (node->direction() == Direction::RIGHT)
+            node = node->parent();
+        return node->parent();
+    }
+
+    static PNode _predecessor(PNode node) {
+        if (node->left)
+            return node->left->max();
+        while (node->direction() == Direction::LEFT)
+            node = node->parent();
+        return node->parent();
+    }
+
+    void _rotate(PNode node, Direction dir) {
+        if (dir == Direction::LEFT)
+            _rotate_left(node);
+        else // (dir == Direction::RIGHT)
+            _rotate_right(node);
+    }
+
+    template<typename Q>
+    PNode _find(const Q& key) const {
+        PNode node = root;
+        while (node) {
+            auto order = _compare(key, node->key);
+            if (order < 0)
+                node = node->left;
+            else if (order > 0)
+                node = node->right;
+            else
+                break;
+        }
+        return node;
+    }
+
+    // First node whose key is not less than `key`.
+    template<typename Q>
+    PNode _lower_bound(const Q& key) const {
+        PNode node = root;
+        PNode bound = nullptr;
+        while (node) {
+            if (_compare(node->key, key) < 0)
+                node = node->right;
+            else {
+                bound = node;
+                node = node->left;
+            }
+        }
+        return bound;
+    }
+
+    // First node whose key is greater than `key`.
+    template<typename Q>
+    PNode _upper_bound(const Q& key) const {
+        PNode node = root;
+        PNode bound = nullptr;
+        while (node) {
+            if (_compare(key, node->key) < 0) {
+                bound = node;
+                node = node->left;
+            }
+            else
+                node = node->right;
+        }
+        return bound;
+    }
+
+    static size_t _subtree_size(PNode node) requires SubtreeSized<AugData> {
+        return node ? node->aug.size : 0;
+    }
+
+    template<typename Q>
+    size_t _rank(const Q& key) const requires SubtreeSized<AugData> {
+        size_t rank = 0;
+        PNode node = root;
+        while (node) {
+            if (_compare(node->key, key) < 0) {
+                rank += _subtree_size(node->left) + 1;
+                node = node->right;
+            }
+            else
+                node = node->left;
+        }
+        return rank;
+    }
+
+    PNode _select(size_t index) const requires SubtreeSized<AugData> {
+        PNode node = root;
+        while (node) {
+            size_t left_size = _subtree_size(node->left);
+            if (index < left_size)
+                node = node->left;
+            else if (index == left_size)
+                break;
+            else {
+                index -= left_size + 1;
+                node = node->right;
+            }
+        }
+        return node;
+    }
+
+    // Folds the entries with keys in [lo, hi): one descent to the node splitting the range,
+    // then one walk down each side picking up whole subtrees.
+    template<typename Q> requires Aggregating<Augment>
+    auto _aggregate(const Q& lo, const Q& hi) const {
+        using M = typename Augment::Monoid;
+        auto total = [](PNode node) {
+            return node ? node->aug.total : M::identity();
+        };
+
+        PNode split = root;
+        while (split) {
+            if (_compare(split->key, lo) < 0)
+                split = split->right;
+            else if (_compare(split->key, hi) >= 0)
+                split = split->left;
+            else
+                break;
+        }
+        if (! split)
+            return M::identity();
+
+        auto left_part = M::identity();
+        for (PNode node = split->left; node; ) {
+            if (_compare(node->key, lo) < 0)
+                node = node->right;
+            else {
+                left_part = M::combine(M::combine(M::lift(node->key, node->value), total(node->right)), left_part);
+                node = node->left;
+            }
+        }
+
+        auto right_part = M::identity();
+        for (PNode node = split->right; node; ) {
+            if (_compare(node->key, hi) < 0) {
+                right_part = M::combine(right_part, M::combine(total(node->left), M::lift(node->key, node->value)));
+                node = node->right;
+            }
+            else
+                node = node->left;
+        }
+
+        return M::combine(M::combine(left_part, M::lift(split->key, split->value)), right_part);
+    }
+
+    // Join-based operations work on detached subtrees: roots have no parent,
+    // and the root of the whole map is blackened by the public entry points.
+
+    static PNode _detach(PNode node) {
+        if (node) node->set_parent(nullptr);
+        return node;
+    }
+
+    static void _set_children(PNode node, PNode left, PNode right) {
+        node->left = left;
+        node->right = right;
+        if (left) left->set_parent(node);
+        if (right) right->set_parent(node);
+        _pull(node);
+    }
+
+    // Black nodes on the leftmost path, which is the same on every path.
+    static int _black_height(PNode node) {
+        int height = 0;
+        for (; node; node = node->left)
+            if (node->is_black()) ++ height;
+        return height;
+    }
+
+    // Subtree rotations returning the new subtree root, whose parent is left for the caller.
+    static PNode _lift_right(PNode node) {
+        PNode rep = node->right;
+        _set_children(node, node->left, rep->left);
+        _set_children(rep, node, rep->right);
+        return rep;
+    }
+    static PNode _lift_left(PNode node) {
+        PNode rep = node->left;
+        _set_children(node, rep->right, node->right);
+        _set_children(rep, rep->left, node);
+        return rep;
+    }
+
+    // Hangs `mid` and `right` off the right spine of `left`, which is at least as black-tall.
+    static PNode _join_right(PNode left, int left_height, PNode mid, PNode right, int right_height) {
+        if (left_height == right_height && (! left || left->is_black())) {
+            mid->set_color(Color::RED);
+            _set_children(mid, left, right);
+            return mid;
+        }
+
+        int child_height = left_height - (left->is_black() ? 1 : 0);
+        PNode child = _join_right(left->right, child_height, mid, right, right_height);
+        _set_children(left, left->left, child);
+        if (left->is_black() && child->is_red() && child->right && child->right->is_red()) {
+            child->right->set_color(Color::BLACK);
+            return _lift_right(left);
+        }
+        return left;
+    }
+
+    static PNode _join_left(PNode left, int left_height, PNode mid, PNode right, int right_height) {
+        if (left_height == right_height && (! right || right->is_black())) {
+            mid->set_color(Color::RED);
+            _set_children(mid, left, right);
+            return mid;
+        }
+
+        int child_height = right_height - (right->is_black() ? 1 : 0);
+        PNode child = _join_left(left, left_height, mid, right->left, child_height);
+        _set_children(right, child, right->right);
+        if (right->is_black() && child->is_red() && child->left && child->left->is_red()) {
+            child->left->set_color(Color::BLACK);
+            return _lift_left(right);
+        }
+        return right;
+    }
+
+    // Every key in `left` < `mid->key` < every key in `right`.
+    static PNode _join(PNode left, PNode mid, PNode right) {
+        // Blackening a root keeps a tree valid and leaves only black roots to join.
+        if (left) left->set_color(Color::BLACK);
+        if (right) right->set_color(Color::BLACK);
+
+        int left_height = _black_height(left);
+        int right_height = _black_height(right);
+        PNode joined;
+        if (left_height > right_height) {
+            joined = _join_right(left, left_height, mid, right, right_height);
+            if (joined->is_red() && joined->right && joined->right->is_red())
+                joined->set_color(Color::BLACK);
+        }
+        else if (left_height < right_height) {
+            joined = _join_left(left, left_height, mid, right, right_height);
+            if (joined->is_red() && joined->left && joined->left->is_red())
+                joined->set_color(Color::BLACK);
+        }
+        else {
+            mid->set_color(Color::RED);
+            _set_children(mid, left, right);
+            joined = mid;
+        }
+        return _detach(joined);
+    }
+
+    // Removes the maximum of a non-empty subtree, returning the rest and the detached maximum.
+    static std::pair<PNode, PNode> _split_last(PNode node) {
+        PNode left = _detach(node->left);
+        PNode right = _detach(node->right);
+        if (! right) {
+            node->left = nullptr;
+            return { left, node };
+        }
+        auto [ rest, last ] = _split_last(right);
+        return { _join(left, node, rest), last };
+    }
+
+    static PNode _join2(PNode left, PNode right) {
+        if (! left) return right;
+        if (! right) return left;
+        auto [ rest, last ] = _split_last(left);
+        return _join(rest, last, right);
+    }
+
+    struct Split {
+        PNode left;
+        PNode found;
+        PNode right;
+    };
+
+    // Splits a detached subtree into keys below `key`, the node holding `key` and keys above it.
+    template<typename Q>
+    Split _split(PNode node, const Q& key) const {
+        if (! node)
+            return { nullptr, nullptr, nullptr };
+
+        PNode left = _detach(node->left);
+        PNode right = _detach(node->right);
+        auto order = _compare(key, node->key);
+        if (order == 0) {
+            node->left = node->right = nullptr;
+            return { left, node, right };
+        }
+        if (order < 0) {
+            Split split = _split(left, key);
+            return { split.left, split.found, _join(split.right, node, right) };
+        }
+        Split split = _split(right, key);
+        return { _join(left, node, split.left), split.found, split.right };
+    }
+
+    // Nodes dropped by set operations; destroyed (and counted) once the result is assembled.
+    using Garbage = std::vector<PNode>;
+
+    static PNode _take_root(PNode node, PNode& left, PNode& right) {
+        left = _detach(node->left);
+        right = _detach(node->right);
+        node->left = node->right = nullptr;
+        return node;
+    }
+
+    // Below this many entries a divide step is cheaper than starting a thread for it.
+    static constexpr size_t PARALLEL_CUTOFF = 1 << 12;
+
+    // Entries under `first` and `second`: exact with subtree sizes, otherwise `estimate`,
+    // which callers halve at every level from the sizes of the whole maps.
+    static size_t _work(PNode first, PNode second, size_t estimate) {
+        if constexpr (SubtreeSized<AugData>)
+            return (first ? first->aug.size : 0) + (second ? second->aug.size : 0);
+        else
+            return estimate;
+    }
+
+    // Runs both halves of a divide step, forking the left one while `forks` lasts
+    // and the step spans at least PARALLEL_CUTOFF entries.
+    template<typename F>
+    static std::pair<PNode, PNode> _fork(int forks, size_t work, Garbage& garbage, F&& left_half, F&& right_half) {
+        if (forks <= 0 || work < PARALLEL_CUTOFF)
+            return { left_half(garbage), right_half(garbage) };
+
+        Garbage left_garbage;
+        auto left = std::async(std::launch::async, [&] {
+            return left_half(left_garbage);
+        });
+        PNode right = right_half(garbage);
+        PNode joined_left = left.get();
+        garbage.insert(garbage.end(), left_garbage.begin(), left_garbage.end());
+        return { joined_left, right };
+    }
+
+    // Entries of `first` win over equal keys in `second`.
+    PNode _unite(PNode first, PNode second, Garbage& garbage, int forks, size_t work) const {
+        if (! first) return second;
+        if (! second) return first;
+
+        work = _work(first, second, work);
+        PNode second_left, second_right;
+        PNode mid = _take_root(second, second_left, second_right);
+        Split split = _split(first, mid->key);
+        auto half = [&](PNode a, PNode b) {
+            return [this, a, b, forks, work](Garbage& garbage) {
+                return _unite(a, b, garbage, forks - 1, work / 2);
+            };
+        };
+        auto [ left, right ] = _fork(forks, work, garbage, half(split.left, second_left), half(split.right, second_right));
+        if (split.found) {
+            garbage.push_back(mid);
+            mid = split.found;
+        }
+        return _join(left, mid, right);
+    }
+
+    PNode _intersect(PNode first, PNode second, Garbage& garbage, int forks, size_t work) const {
+        if (! first || ! second) {
+            if (first) garbage.push_back(first);
+            if (second) garbage.push_back(second);
+            return nullptr;
+        }
+
+        work = _work(first, second, work);
+        PNode second_left, second_right;
+        PNode mid = _take_root(second, second_left, second_right);
+        Split split = _split(first, mid->key);
+        auto half = [&](PNode a, PNode b) {
+            return [this, a, b, forks, work](Garbage& garbage) {
+                return _intersect(a, b, garbage, forks - 1, work / 2);
+            };
+        };
+        auto [ left, right ] = _fork(forks, work, garbage, half(split.left, second_left), half(split.right, second_right));
+        garbage.push_back(mid);
+        if (split.found)
+            return _join(left, split.found, right);
+        return _join2(left, right);
+    }
+
+    PNode _subtract(PNode first, PNode second, Garbage& garbage, int forks, size_t work) const {
+        if (! first || ! second) {
+            if (second) garbage.push_back(second);
+            return first;
+        }
+
+        work = _work(first, second, work);
+        PNode second_left, second_right;
+        PNode mid = _take_root(second, second_left, second_right);
+        Split split = _split(first, mid->key);
+        auto half = [&](PNode a, PNode b) {
+            return [this, a, b, forks, work](Garbage& garbage) {
+                return _subtract(a, b, garbage, forks - 1, work / 2);
+            };
+        };
+        auto [ left, right ] = _fork(forks, work, garbage, half(split.left, second_left), half(split.right, second_right));
+        garbage.push_back(mid);
+        if (split.found) garbage.push_back(split.found);
+        return _join2(left, right);
+    }
+
+    // Levels to fork at: 2^levels tasks run at the bottom, about one per hardware thread.
+    static int _forks(Execution execution) {
+        if (execution == Execution::SEQUENTIAL)
+            return 0;
+        return std::bit_width(std::max(std::thread::hardware_concurrency(), 1u)) - 1;
+    }
+
+    // Takes over the nodes of `that` and finishes a set operation producing `joined`.
+    template<typename Op>
+    void _combine(TreeMap&& that, Execution execution, Op op) {
+        pool.adopt(that.pool);
+        size_t total = _size + that._size;
+        Garbage garbage;
+        PNode joined = (this->*op)(root, that.root, garbage, _forks(execution), total);
+        that.root = nullptr;
+        that._size = 0;
+
+        for (PNode node : garbage)
+            total -= _destroy_subtree(node);
+        root = joined;
+        if (root) root->set_color(Color::BLACK);
+        _size = total;
+    }
+
+    static constexpr size_t LOOKUP_LANES = 16;
+
+    template<typename Q>
+    void _get_many(std::span<const Q> keys, std::span<const V*> out) const {
+        assert(out.size() >= keys.size());
+        for (size_t base = 0; base < keys.size(); base += LOOKUP_LANES) {
+            size_t lanes = std::min(LOOKUP_LANES, keys.size() - base);
+            PNode nodes[LOOKUP_LANES];
+            for (size_t i = 0; i < lanes; ++ i) {
+                nodes[i] = root;
+                out[base + i] = nullptr;
+            }
+
+            for (bool active = root != nullptr; active; ) {
+                active = false;
+                for (size_t i = 0; i < lanes; ++ i) {
+                    PNode node = nodes[i];
+                    if (! node) continue;
+                    auto order = _compare(keys[base + i], node->key);
+                    if (order == 0) {
+                        out[base + i] = &node->value;
+                        node = nullptr;
+                    }
+                    else {
+                        node = order < 0 ? node->left : node->right;
+                        if (node) {
+                            __builtin_prefetch(node);
+                            active = true;
+                        }
+                    }
+                    nodes[i] = node;
+                }
+            }
+        }
+    }
+
+    template<typename Q, typename F>
+    const V& _get_or(const Q& key, F&& on_not_found) const {
+        if (PNode node = _find(key))
+            return node->value;
+        return std::forward<F>(on_not_found)();
+    }
+
+    template<typename Q>
+    const V& _get(const Q& key) const {
+        return _get_or(key, [&key] -> const V& {
+            throw std::out_of_range(std::format("Key '{}' not found", key));
+        });
+    }
+
+    template<typename Q>
+    bool _remove(const Q& key) {
+        PNode node = _find(key);
+        if (! node)
+            return false;
+        _remove_node(node);
+        -- _size;
+        return true;
+    }
+
+    // Where `key` is, or the empty link it would hang from. `link` only matters in the latter case.
+    struct Slot {
+        PNode node;
+        PNode parent;
+        PNode* link;
+    };
+
+    template<typename Q>
+    Slot _locate(const Q& key) {
+        return _locate_from(root, key);
+    }
+
+    // Descends from `node`, whose subtree must span the position of `key`.
+    template<typename Q>
+    Slot _locate_from(PNode node, const Q& key) {
+        PNode parent = nullptr;
+        PNode* link = &root;
+        while (node) {
+            auto order = _compare(key, node->key);
+            if (order == 0)
+                return { node, parent, link };
+            parent = node;
+            link = order < 0 ? &node->left : &node->right;
+            node = *link;
+        }
+        return { nullptr, parent, link };
+    }
+
+    // Climbs from `finger` to the lowest ancestor whose subtree spans the position of a `key`
+    // not less than the finger's. A subtree reached from a left child ends at its parent's key,
+    // so only those parents need comparing. The climb stops early for a nearby key, but may
+    // still reach the root when the finger sits beside an ancestor's key: O(log n) worst case.
+    template<typename Q>
+    PNode _climb(PNode finger, const Q& key) const {
+        PNode node = finger;
+        while (PNode parent = node->parent()) {
+            if (node->direction() == Direction::LEFT && _compare(key, parent->key) < 0)
+                break;
+            node = parent;
+        }
+        return node;
+    }
+
+    // Mirror of `_climb` for a `key` not greater than the finger's.
+    template<typename Q>
+    PNode _climb_back(PNode finger, const Q& key) const {
+        PNode node = finger;
+        while (PNode parent = node->parent()) {
+            if (node->direction() == Direction::RIGHT && _compare(key, parent->key) > 0)
+                break;
+            node = parent;
+        }
+        return node;
+    }
+
+    // First node not less than `key`, searching the subtree of `node` that spans its position.
+    template<typename Q>
+    PNode _lower_bound_from(PNode node, const Q& key) const {
+        PNode candidate = nullptr;
+        PNode last = nullptr;
+        while (node) {
+            last = node;
+            if (_compare(node->key, key) < 0)
+                node = node->right;
+            else {
+                candidate = node;
+                node = node->left;
+            }
+        }
+        // Every key in the subtree is smaller, so the answer is the ancestor bounding it
+        return candidate || ! last ? candidate : _successor(last);
+    }
+
+    PNode _link(const Slot& slot, PNode created) {
+        created->set_parent(slot.parent);
+        *slot.link = created;
+        _pull_path(created);
+        _insert(created);
+        return created;
+    }
+
+    // Unlinks `node` and resets it to a fresh red leaf, ready to be linked anywhere.
+    PNode _take_node(PNode node) {
+        _unlink_node(node);
+        -- _size;
+        node->left = node->right = nullptr;
+        node->parent_color = static_cast<uintptr_t>(Color::RED);
+        return node;
+    }
+
+    template<typename F>
+    V& _get_or_insert(const K& key, F&& make_value) {
+        Slot slot = _locate(key);
+        if (slot.node)
+            return slot.node->value;
+        return _link(slot, _create(key, std::forward<F>(make_value)()))->value;
+    }
+
+    void _insert(PNode node) {
+        ++ _size;
+        _maintain_after_insert(node);
+    }
+
+    void _maintain_after_insert(PNode node) {
+        // Case 4 hands the violation two levels up, so this loops rather than recursing.
+        for (;;) {
+            // Case 1: Empty tree
+            if (! node->parent()) {
+                TREEMAP_COUNT(insert_cases[0]);
+                return;
+            }
+
+            // Case 2: Parent is black
+            if (node->parent()->is_black()) {
+                TREEMAP_COUNT(insert_cases[1]);
+                return;
+            }
+
+            // Case 3: Parent is red and parent is root
+            if (node->parent() == root) {
+                TREEMAP_COUNT(insert_cases[2]);
+                _recolor(node->parent(), Color::BLACK);
+                return;
+            }
+
+            PNode parent = node->parent();
+            PNode grandparent = parent->parent();
+            PNode uncle = parent->sibling();
+
+            // Case 4: Parent and uncle are red
+            if (uncle && uncle->is_red()) {
+                TREEMAP_COUNT(insert_cases[3]);
+                _recolor(parent, Color::BLACK);
+                _recolor(uncle, Color::BLACK);
+                _recolor(grandparent, Color::RED);
+                node = grandparent;
+                continue;
+            }
+
+            // Case 5: Parent is red and uncle is black
+
+            // Case 5.1: Node has different direction with parent
+            Direction parentDir = parent->direction();
+            if (node->direction() != parentDir) {
+                TREEMAP_COUNT(insert_cases[4]);
+                _rotate(parent, parentDir);
+                parent = node;
+            }
+
+            // Case 5.2: Node has same direction with parent
+            TREEMAP_COUNT(insert_cases[5]);
+            _rotate(grandparent, - parentDir);
+            _recolor(parent, Color::BLACK);
+            _recolor(grandparent, Color::RED);
+            return;
+        }
+    }
+
+    // Exchanges the tree positions and colors of `node` and its in-order predecessor,
+    // leaving the key order momentarily broken until `node` is unlinked.
+    void _swap_with_predecessor(PNode node) {
+        PNode prev = node->left->max();
+        PNode parent = node->parent();
+        Direction dir = node->direction();
+        Color color = node->color();
+        PNode prev_left = prev->left;
+
+        if (prev == node->left) {
+            prev->left = node;
+            node->set_parent(prev);
+        }
+        else {
+            PNode prev_parent = prev->parent();
+            prev_parent->right = node;
+            node->set_parent(prev_parent);
+            prev->left = node->left;
+            prev->left->set_parent(prev);
+        }
+        prev->right = node->right;
+        prev->right->set_parent(prev);
+        node->left = prev_left;
+        if (prev_left) prev_left->set_parent(node);
+        node->right = nullptr;
+
+        prev->set_parent(parent);
+        switch (dir) {
+            case Direction::LEFT:
+                parent->left = prev;
+                break;
+            case Direction::RIGHT:
+                parent->right = prev;
+                break;
+            case Direction::ROOT:
+                root = prev;
+                break;
+        }
+        node->set_color(prev->color());
+        prev->set_color(color);
+    }
+
+    // Takes `node` out of the tree and rebalances, without destroying it.
+    void _unlink_node(PNode node) {
+        assert(node);
+
+        // Case 1: Node is the only one in the tree
+        if (_size == 1) {
+            root = nullptr;
+            return;
+        }
+
+        // Case 2: Node has two children, so it trades places with its predecessor,
+        //         which has at most one. Nodes are relinked, never copied.
+        if (node->left && node->right)
+            _swap_with_predecessor(node);
+
+        // Case 3: Node has only one child,
+        //         so the child must be red,
+        //         and node itself must be black
+        PNode child = node->only_child();
+        if (child) {
+            _replace_node(node, child);
+            _recolor(child, Color::BLACK);
+            _pull_path(child->parent());
+            return;
+        }
+
+        // Case 4: Node has no child
+
+        // Case 4.1: Node is black
+        if (node->is_black()) _maintain_after_remove(node);
+
+        PNode parent = node->parent();
+        _replace_node(node, nullptr);
+        _pull_path(parent);
+    }
+
+    void _remove_node(PNode node) {
+        _unlink_node(node);
+        pool.destroy(node);
+    }
+
+    void _maintain_after_remove(PNode node) {
+        assert(node->is_black());
+
+        // Case 3 moves the extra black up to the parent, so this loops rather than recursing.
+        for (;;) {
+            // Case 0: The extra black reached the root
+            if (! node->parent()) {
+                TREEMAP_COUNT(remove_cases[0]);
+                return;
+            }
+
+            PNode sibling = node->sibling();
+            PNode parent = node->parent();
+
+            // Case 1: Sibling is red
+            if (sibling->is_red()) {
+                TREEMAP_COUNT(remove_cases[1]);
+                _rotate(parent, node->direction());
+                _recolor(sibling, Color::BLACK);
+                _recolor(parent, Color::RED);
+
+                sibling = node->sibling();
+            }
+
+            PNode closeNephew = node->direction() == Direction::LEFT
+                ? sibling->left
+                : sibling->right;
+            PNode distantNephew = node->direction() == Direction::LEFT
+                ? sibling->right
+                : sibling->left;
+
+            bool closeNephewIsBlack = ! closeNephew || closeNephew->is_black();
+            bool distantNephewIsBlack = ! distantNephew || distantNephew->is_black();
+
+            if (closeNephewIsBlack && distantNephewIsBlack) {
+                // Case 2: Both nephews are black and parent is red
+                if (parent->is_red()) {
+                    TREEMAP_COUNT(remove_cases[2]);
+                    _recolor(parent, Color::BLACK);
+                    _recolor(sibling, Color::RED);
+                    return;
+                }
+
+                // Case 3: Both nephews are black and parent is black
+                TREEMAP_COUNT(remove_cases[3]);
+                _recolor(sibling, Color::RED);
+                node = parent;
+                continue;
+            }
+
+            // Case 4: Close nephew is red
+            if (! closeNephewIsBlack) {
+                TREEMAP_COUNT(remove_cases[4]);
+                _rotate(sibling, sibling->direction());
+                _recolor(closeNephew, Color::BLACK);
+                _recolor(sibling, Color::RED);
+                distantNephew = sibling;
+                sibling = closeNephew;
+            }
+
+            // Case 5: Distant nephew is red
+            TREEMAP_COUNT(remove_cases[5]);
+            _rotate(parent, node->direction());
+            _recolor(sibling, parent->color());
+            _recolor(parent, Color::BLACK);
+            _recolor(distantNephew, Color::BLACK);
+            return;
+        }
+    }
+
+    void _print_node(std::ostream& out, PNode node, int depth) const {
+        for (int i = 0; i < depth; ++ i) out << "    ";
+        if (! node) {
+            out << "\x1B[30m∅\x1B[0m" << std::endl;
+            return;
+        }
+        out << (node->is_red() ? "\x1B[31m" : "\x1B[30m") << node->key << "\x1B[0m" << std::endl;
+        _print_node(out, node->left, depth + 1);
+        _print_node(out, node->right, depth + 1);
+    }
+
+public:
+    TreeMap() :
+        root(nullptr),
+        _size(0) {}
+
+    explicit TreeMap(Compare compare) :
+        root(nullptr),
+        _size(0),
+        compare(std::move(compare)) {}
+
+    // Builds the map from entries sorted by strictly increasing key in O(n).
+    template<std::forward_iterator It>
+    static TreeMap from_sorted(It first, It last, Compare compare = Compare()) {
+        TreeMap tree(std::move(compare));
+        size_t count = std::distance(first, last);
+        if (count == 0)
+            return tree;
+
+        size_t red_depth = std::bit_width(count + 1) - 1;
+        PNode prev = nullptr;
+        tree.pool.reserve(count);
+        tree.root = tree._build_sorted(first, count, 0, red_depth, prev);
+        tree._size = count;
+        return tree;
+    }
+
+    TreeMap(const TreeMap&) = delete;
+    TreeMap& operator=(const TreeMap&) = delete;
+
+    TreeMap(TreeMap&& that) noexcept :
+        root(std::exchange(that.root, nullptr)),
+        _size(std::exchange(that._size, 0)),
+        compare(std::move(that.compare)),
+        pool(std::move(that.pool)) {}
+
+    TreeMap& operator=(TreeMap&& that) noexcept {
+        std::swap(root, that.root);
+        std::swap(_size, that._size);
+        std::swap(compare, that.compare);
+        std::swap(pool, that.pool);
+        return *this;
+    }
+
+    ~TreeMap() {
+        _release();
+    }
+
+    const size_t& size = _size;
+
+    inline bool empty() const {
+        return _size == 0;
+    }
+
+    Value* find(const K& key) {
+        PNode node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    Value* find(const Q& key) {
+        PNode node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+
+    const V* find(const K& key) const {
+        PNode node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V* find(const Q& key) const {
+        PNode node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+
+    bool contains(const K& key) const {
+        return _find(key) != nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return _find(key) != nullptr;
+    }
+
+    // Looks up every key, writing a pointer to its value (or nullptr) to the same index of
+    // `out`. Keys are resolved LOOKUP_LANES at a time, stepping all their descents one level
+    // per round and prefetching each next node, so the cache misses of a round overlap.
+    void get_many(std::span<const K> keys, std::span<const V*> out) const {
+        _get_many(keys, out);
+    }
+    // Any contiguous range of lookup keys, e.g. a std::vector<std::string_view>.
+    template<std::ranges::contiguous_range R>
+        requires std::ranges::sized_range<R> && TransparentFor<Compare, std::ranges::range_value_t<R>, K>
+    void get_many(const R& keys, std::span<const V*> out) const {
+        using Q = std::ranges::range_value_t<R>;
+        _get_many(std::span<const Q>(std::ranges::data(keys), std::ranges::size(keys)), out);
+    }
+
+    template<typename F>
+    const V& get_or(const K& key, F&& on_not_found) const {
+        return _get_or(key, std::forward<F>(on_not_found));
+    }
+    template<typename Q, typename F> requires TransparentFor<Compare, Q, K>
+    const V& get_or(const Q& key, F&& on_not_found) const {
+        return _get_or(key, std::forward<F>(on_not_found));
+    }
+
+    const V& get(const K& key) const {
+        return _get(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V& get(const Q& key) const {
+        return _get(key);
+    }
+
+    const V& get_or_else(const K& key, const V& def) const {
+        return _get_or(key, [&def] -> const V& {
+            return def;
+        });
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V& get_or_else(const Q& key, const V& def) const {
+        return _get_or(key, [&def] -> const V& {
+            return def;
+        });
+    }
+
+    template<typename F>
+    Value& get_or_insert(const K& key, F&& func) {
+        return _get_or_insert(key, std::forward<F>(func));
+    }
+
+    Value& set(const K& key, const V& value) {
+        return (*insert_or_assign(key, value).first).second;
+    }
+    Value& set(const K& key, V&& value) {
+        return (*insert_or_assign(key, std::move(value)).first).second;
+    }
+
+    // Applies `func` to the value of `key` in place, keeping augmented data up to date.
+    template<typename F>
+    bool update(const K& key, F&& func) {
+        PNode node = _find(key);
+        if (! node)
+            return false;
+        std::forward<F>(func)(node->value);
+        _pull_path(node);
+        return true;
+    }
+
+    const V& operator[](const K& key) const {
+        return get(key);
+    }
+
+    Value& operator[](const K& key) {
+        return (*try_emplace(key).first).second;
+    }
+    Value& operator[](K&& key) {
+        return (*try_emplace(std::move(key)).first).second;
+    }
+
+    bool remove(const K& key) {
+        return _remove(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool remove(const Q& key) {
+        return _remove(key);
+    }
+
+    // Moves every entry of `right` into this map; all its keys must be greater than ours.
+    void join(TreeMap&& right) {
+        assert(! root || ! right.root || compare(root->max()->key, right.root->min()->key) < 0);
+        pool.adopt(right.pool);
+        root = _join2(root, right.root);
+        if (root) root->set_color(Color::BLACK);
+        _size += right._size;
+        right.root = nullptr;
+        right._size = 0;
+    }
+
+    // Keeps the keys less than `key` and returns a map with the rest, in O(log n).
+    // Without a subtree-size augmentation, counting the returned entries adds time linear in their number.
+    TreeMap split(const K& key) {
+        TreeMap right(compare);
+        right.pool.adopt(pool);
+
+        Split parts = _split(root, key);
+        if (parts.found)
+            parts.right = _join(nullptr, parts.found, parts.right);
+        root = parts.left;
+        right.root = parts.right;
+        if (root) root->set_color(Color::BLACK);
+        if (right.root) right.root->set_color(Color::BLACK);
+
+        right._size = _count_subtree(right.root);
+        _size -= right._size;
+        return right;
+    }
+
+    // Set operations in O(m log(n / m + 1)) for sizes m <= n, consuming `that`.
+    // Execution::PARALLEL forks the independent halves of the top recursion levels,
+    // as long as they span enough entries to pay for a thread.
+
+    // Adds the entries of `that` whose keys are missing here.
+    void unite(TreeMap&& that, Execution execution = Execution::SEQUENTIAL) {
+        _combine(std::move(that), execution, &TreeMap::_unite);
+    }
+
+    // Keeps only the entries whose keys are also in `that`.
+    void intersect(TreeMap&& that, Execution execution = Execution::SEQUENTIAL) {
+        _combine(std::move(that), execution, &TreeMap::_intersect);
+    }
+
+    // Drops the entries whose keys are in `that`.
+    void subtract(TreeMap&& that, Execution execution = Execution::SEQUENTIAL) {
+        _combine(std::move(that), execution, &TreeMap::_subtract);
+    }
+
+#ifdef TREEMAP_STATS
+    // Snapshot of the counters, plus depths measured over the current tree in O(n).
+    TreeMapStats stats() const {
+        TreeMapStats stats;
+        stats.comparisons = _counters.comparisons.load(std::memory_order_relaxed);
+        stats.rotations_left = _counters.rotations_left.load(std::memory_order_relaxed);
+        stats.rotations_right = _counters.rotations_right.load(std::memory_order_relaxed);
+        stats.recolorings = _counters.recolorings.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < stats.insert_cases.size(); ++ i)
+            stats.insert_cases[i] = _counters.insert_cases[i].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < stats.remove_cases.size(); ++ i)
+            stats.remove_cases[i] = _counters.remove_cases[i].load(std::memory_order_relaxed);
+        stats.allocations = _counters.allocations.load(std::memory_order_relaxed);
+
+        size_t total = 0;
+        _depths(root, 0, stats.max_depth, total);
+        stats.average_depth = _size ? static_cast<double>(total) / _size : 0;
+        return stats;
+    }
+
+    void reset_stats() {
+        _counters.comparisons = 0;
+        _counters.rotations_left = 0;
+        _counters.rotations_right = 0;
+        _counters.recolorings = 0;
+        for (auto& count : _counters.insert_cases) count = 0;
+        for (auto& count : _counters.remove_cases) count = 0;
+        _counters.allocations = 0;
+    }
+#endif
+
+    void print(std::ostream &out = std::cout) const {
+        _print_node(out, root, 0);
+    }
+
+    // Iterators are a node plus the owning tree, the latter only needed to step back from end().
+    template<typename VI, typename Derefer>
+    struct IteratorBase {
+    private:
+        friend TreeMap;
+
+        PNode node;
+        const TreeMap* tree;
+        [[no_unique_address]] std::remove_const_t<Derefer> deref {};
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::remove_cvref_t<VI>;
+        using difference_type = std::ptrdiff_t;
+        using reference = VI;
+
+        IteratorBase() :
+            node(nullptr),
+            tree(nullptr) {}
+
+        IteratorBase(PNode node, const TreeMap* tree) :
+            node(node),
+            tree(tree) {}
+
+        IteratorBase& operator++() {
+            node = _successor(node);
+            return *this;
+        }
+        IteratorBase operator++(int) {
+            IteratorBase old = *this;
+            ++ *this;
+            return old;
+        }
+
+        IteratorBase& operator--() {
+            node = node ? _predecessor(node) : tree->root->max();
+            return *this;
+        }
+        IteratorBase operator--(int) {
+            IteratorBase old = *this;
+            -- *this;
+            return old;
+        }
+
+        VI operator*() const {
+            return deref(node);
+        }
+
+        operator bool() const {
+            return node != nullptr;
+        }
+
+        bool operator==(const IteratorBase& that) const {
+            return node == that.node;
+        }
+    };
+
+    static constexpr auto ValueDerefer = [](PNode node) -> Value& {
+        return node->value;
+    };
+    using Iterator = IteratorBase<Value&, decltype(ValueDerefer)>;
+    Iterator begin() {
+        if (empty()) return end();
+        return { root->min(), this };
+    }
+    inline Iterator end() const {
+        return { nullptr, this };
+    }
+
+    static constexpr auto ConstValueDerefer = [](PNode node) -> const V& {
+        return node->value;
+    };
+    using ConstIterator = IteratorBase<const V&, decltype(ConstValueDerefer)>;
+    ConstIterator cbegin() const {
+        if (empty()) return cend();
+        return { root->min(), this };
+    }
+    inline ConstIterator cend() const {
+        return { nullptr, this };
+    }
+
+    using Entry = std::pair<const K&, Value&>;
+    static constexpr auto EntryDerefer = [](PNode node) -> Entry {
+        return { node->key, node->value };
+    };
+    using EntryIterator = IteratorBase<Entry, decltype(EntryDerefer)>;
+    EntryIterator entry_begin() {
+        if (empty()) return entry_end();
+        return { root->min(), this };
+    }
+    inline EntryIterator entry_end() const {
+        return { nullptr, this };
+    }
+
+    using ConstEntry = std::pair<const K&, const V&>;
+    static constexpr auto ConstEntryDerefer = [](PNode node) -> ConstEntry {
+        return { node->key, node->value };
+    };
+    using ConstEntryIterator = IteratorBase<ConstEntry, decltype(ConstEntryDerefer)>;
+    ConstEntryIterator entry_cbegin() const {
+        if (empty()) return entry_cend();
+        return { root->min(), this };
+    }
+    inline ConstEntryIterator entry_cend() const {
+        return { nullptr, this };
+    }
+
+    struct Entries {
+        TreeMap& tree;
+
+        Entries(TreeMap& tree) : tree(tree) {}
+
+        EntryIterator begin() {
+            return tree.entry_begin();
+        }
+        EntryIterator end() const {
+            return tree.entry_end();
+        }
+        ConstEntryIterator cbegin() const {
+            return tree.entry_cbegin();
+        }
+        ConstEntryIterator cend() const {
+            return tree.entry_cend();
+        }
+    } entries { *this };
+
+    static constexpr auto KeyDerefer = [](PNode node) -> const K& {
+        return node->key;
+    };
+    using KeyIterator = IteratorBase<const K&, decltype(KeyDerefer)>;
+    KeyIterator key_begin() const {
+        if (empty()) return key_end();
+        return { root->min(), this };
+    }
+    inline KeyIterator key_end() const {
+        return { nullptr, this };
+    }
+
+    struct Keys {
+        TreeMap& tree;
+
+        Keys(TreeMap& tree) : tree(tree) {}
+
+        KeyIterator begin() const {
+            return tree.key_begin();
+        }
+        KeyIterator end() const {
+            return tree.key_end();
+        }
+        KeyIterator cbegin() const {
+            return tree.key_begin();
+        }
+        KeyIterator cend() const {
+            return tree.key_end();
+        }
+    } keys { *this };
+
+    template<typename It>
+    struct RangeBase {
+        It first;
+        It last;
+
+        It begin() const {
+            return first;
+        }
+        It end() const {
+            return last;
+        }
+        bool empty() const {
+            return first == last;
+        }
+    };
+    using Range = RangeBase<EntryIterator>;
+    using ConstRange = RangeBase<ConstEntryIterator>;
+
+    // Inserts a node built from `key` and `args` unless the key is present. As with
+    // std::map, the node is constructed first, so it is discarded if the key exists.
+    template<typename KArg, typename... VArgs>
+    std::pair<EntryIterator, bool> emplace(KArg&& key, VArgs&&... args) {
+        PNode created = _create(std::forward<KArg>(key), std::forward<VArgs>(args)...);
+        Slot slot = _locate(created->key);
+        if (slot.node) {
+            pool.destroy(created);
+            return { { slot.node, this }, false };
+        }
+        return { { _link(slot, created), this }, true };
+    }
+
+    // Inserts `key` with a value built from `args` if the key is absent. Nothing is
+    // constructed or moved from when the key is present.
+    template<typename... VArgs>
+    std::pair<EntryIterator, bool> try_emplace(const K& key, VArgs&&... args) {
+        Slot slot = _locate(key);
+        if (slot.node)
+            return { { slot.node, this }, false };
+        return { { _link(slot, _create(key, std::forward<VArgs>(args)...)), this }, true };
+    }
+    template<typename... VArgs>
+    std::pair<EntryIterator, bool> try_emplace(K&& key, VArgs&&... args) {
+        Slot slot = _locate(key);
+        if (slot.node)
+            return { { slot.node, this }, false };
+        return { { _link(slot, _create(std::move(key), std::forward<VArgs>(args)...)), this }, true };
+    }
+
+    // Owns a node taken out of a TreeMap, so it can move to another map of the same type
+    // without reallocating or copying its entry. It also holds a share of the source pool,
+    // which keeps arena storage alive for as long as the node needs it.
+    struct NodeHandle {
+    private:
+        friend TreeMap;
+
+        PNode node;
+        [[no_unique_address]] Pool pool;
+
+        NodeHandle(PNode node, const Pool& source) :
+            node(node) {
+            pool.adopt(source);
+        }
+
+    public:
+        NodeHandle() :
+            node(nullptr) {}
+
+        NodeHandle(const NodeHandle&) = delete;
+        NodeHandle& operator=(const NodeHandle&) = delete;
+
+        NodeHandle(NodeHandle&& that) noexcept :
+            node(std::exchange(that.node, nullptr)),
+            pool(std::move(that.pool)) {}
+
+        NodeHandle& operator=(NodeHandle&& that) noexcept {
+            std::swap(node, that.node);
+            std::swap(pool, that.pool);
+            return *this;
+        }
+
+        ~NodeHandle() {
+            if (node) pool.destroy(node);
+        }
+
+        bool empty() const {
+            return node == nullptr;
+        }
+
+        explicit operator bool() const {
+            return node != nullptr;
+        }
+
+        // The key may be changed while the node is outside any map.
+        K& key() const {
+            return node->key;
+        }
+
+        V& value() const {
+            return node->value;
+        }
+    };
+
+    struct InsertResult {
+        EntryIterator position;
+        bool inserted;
+        NodeHandle node;
+    };
+
+    // Unlinks the entry of `key` and hands its node over, or returns an empty handle.
+    NodeHandle extract(const K& key) {
+        PNode node = _find(key);
+        if (! node)
+            return {};
+        return { _take_node(node), pool };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    NodeHandle extract(const Q& key) {
+        PNode node = _find(key);
+        if (! node)
+            return {};
+        return { _take_node(node), pool };
+    }
+
+    // Links the node of `handle` in if its key is absent. Otherwise the node stays in the
+    // returned handle, and `position` points at the entry that blocked it.
+    InsertResult insert(NodeHandle&& handle) {
+        if (! handle)
+            return { entry_end(), false, {} };
+
+        Slot slot = _locate(handle.node->key);
+        if (slot.node)
+            return { { slot.node, this }, false, std::move(handle) };
+
+        pool.adopt(handle.pool);
+        PNode node = std::exchange(handle.node, nullptr);
+        _link(slot, node);
+        return { { node, this }, true, {} };
+    }
+
+    // Removes the entry at `pos` without searching for its key, returning the next position.
+    // Other nodes are relinked rather than moved, so iterators to them stay valid.
+    template<typename VI, typename Derefer>
+    IteratorBase<VI, Derefer> erase(IteratorBase<VI, Derefer> pos) {
+        PNode next = _successor(pos.node);
+        _remove_node(pos.node);
+        -- _size;
+        return { next, this };
+    }
+
+    // Removes the entries in [first, last) in O(log n + k): two splits cut the range out
+    // as one subtree, a join closes the gap, and only the k removed nodes are visited.
+    template<typename VI, typename Derefer>
+    IteratorBase<VI, Derefer> erase(IteratorBase<VI, Derefer> first, IteratorBase<VI, Derefer> last) {
+        if (first == last)
+            return last;
+
+        Split head = _split(root, first.node->key);
+        PNode middle = _join(nullptr, head.found, head.right);
+        PNode rest = nullptr;
+        if (last.node) {
+            Split tail = _split(middle, last.node->key);
+            middle = tail.left;
+            rest = _join(nullptr, tail.found, tail.right);
+        }
+        root = _join2(head.left, rest);
+        if (root) root->set_color(Color::BLACK);
+
+        _size -= _destroy_subtree(middle);
+        return last;
+    }
+
+    // Upserts entries sorted by non-decreasing key, like `set` on each but cheaper: every
+    // search starts from the previous entry's node and climbs only as far as needed (see
+    // `_climb`). A single entry still costs O(log n) in the worst case, but a dense batch
+    // sweeps the tree monotonically and is cheap amortized. Returns the number of new keys.
+    template<std::input_iterator It>
+    size_t insert_sorted_batch(It first, It last) {
+        size_t inserted = 0;
+        PNode finger = nullptr;
+        for (; first != last; ++ first) {
+            const auto& [ key, value ] = *first;
+            assert(! finger || _compare(finger->key, key) <= 0);
+
+            Slot slot = _locate_from(finger ? _climb(finger, key) : root, key);
+            if (slot.node) {
+                slot.node->value = value;
+                _pull_path(slot.node);
+                finger = slot.node;
+                continue;
+            }
+            finger = _link(slot, _create(key, value));
+            ++ inserted;
+        }
+        return inserted;
+    }
+
+    // Assigns `value` to `key`, inserting it if absent. The second member is true on insertion.
+    template<typename M>
+    std::pair<EntryIterator, bool> insert_or_assign(const K& key, M&& value) {
+        Slot slot = _locate(key);
+        if (slot.node) {
+            slot.node->value = std::forward<M>(value);
+            _pull_path(slot.node);
+            return { { slot.node, this }, false };
+        }
+        return { { _link(slot, _create(key, std::forward<M>(value))), this }, true };
+    }
+    template<typename M>
+    std::pair<EntryIterator, bool> insert_or_assign(K&& key, M&& value) {
+        Slot slot = _locate(key);
+        if (slot.node) {
+            slot.node->value = std::forward<M>(value);
+            _pull_path(slot.node);
+            return { { slot.node, this }, false };
+        }
+        return { { _link(slot, _create(std::move(key), std::forward<M>(value))), this }, true };
+    }
+
+    // A position that remembers where it is: `seek` starts from the current entry and climbs
+    // parent links only until the subtree spans the target, then descends from there. A seek
+    // whose climb crosses the root still costs O(log n), but a monotone sweep over the map
+    // climbs each edge a bounded number of times, so nearby targets are cheap amortized.
+    // Removing the entry a cursor rests on invalidates it, as with iterators.
+    struct Cursor {
+    private:
+        TreeMap* tree;
+        PNode node;     // Current entry, where the next seek starts; nullptr past either end
+
+        // Past either end the cursor holds no node at all, so it cannot dangle, and the next
+        // seek descends from the root.
+        template<typename Q>
+        bool _seek(const Q& key) {
+            PNode start = tree->root;
+            if (node) {
+                auto order = tree->_compare(key, node->key);
+                if (order == 0)
+                    return true;
+                start = order > 0 ? tree->_climb(node, key) : tree->_climb_back(node, key);
+            }
+            node = tree->_lower_bound_from(start, key);
+            return node != nullptr;
+        }
+
+    public:
+        explicit Cursor(TreeMap& tree) :
+            tree(&tree),
+            node(nullptr) {}
+
+        // Moves to the first entry whose key is not less than `key`, like `lower_bound`.
+        // Returns whether there is one.
+        bool seek(const K& key) {
+            return _seek(key);
+        }
+        template<typename Q> requires TransparentFor<Compare, Q, K>
+        bool seek(const Q& key) {
+            return _seek(key);
+        }
+
+        bool valid() const {
+            return node != nullptr;
+        }
+
+        const K& key() const {
+            return node->key;
+        }
+
+        Value& value() const {
+            return node->value;
+        }
+
+        // Steps to the neighbouring entry. Stepping back from past the end lands on the last one.
+        Cursor& next() {
+            node = _successor(node);
+            return *this;
+        }
+
+        Cursor& prev() {
+            node = node ? _predecessor(node) : (tree->root ? tree->root->max() : nullptr);
+            return *this;
+        }
+    };
+
+    Cursor cursor() {
+        return Cursor(*this);
+    }
+
+    EntryIterator lower_bound(const K& key) {
+        return { _lower_bound(key), this };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    EntryIterator lower_bound(const Q& key) {
+        return { _lower_bound(key), this };
+    }
+    ConstEntryIterator lower_bound(const K& key) const {
+        return { _lower_bound(key), this };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    ConstEntryIterator lower_bound(const Q& key) const {
+        return { _lower_bound(key), this };
+    }
+
+    EntryIterator upper_bound(const K& key) {
+        return { _upper_bound(key), this };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    EntryIterator upper_bound(const Q& key) {
+        return { _upper_bound(key), this };
+    }
+    ConstEntryIterator upper_bound(const K& key) const {
+        return { _upper_bound(key), this };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    ConstEntryIterator upper_bound(const Q& key) const {
+        return { _upper_bound(key), this };
+    }
+
+    // Keys are unique, so the range holds at most one entry.
+    Range equal_range(const K& key) {
+        return { lower_bound(key), upper_bound(key) };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    Range equal_range(const Q& key) {
+        return { lower_bound(key), upper_bound(key) };
+    }
+    ConstRange equal_range(const K& key) const {
+        return { lower_bound(key), upper_bound(key) };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    ConstRange equal_range(const Q& key) const {
+        return { lower_bound(key), upper_bound(key) };
+    }
+
+    // Number of keys less than `key`. Needs a subtree-size augmentation such as OrderStatistics.
+    size_t rank(const K& key) const requires SubtreeSized<AugData> {
+        return _rank(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K> && SubtreeSized<AugData>
+    size_t rank(const Q& key) const {
+        return _rank(key);
+    }
+
+    // The entry at zero-based position `index` in key order, or the end iterator.
+    EntryIterator select(size_t index) requires SubtreeSized<AugData> {
+        return { _select(index), this };
+    }
+    ConstEntryIterator select(size_t index) const requires SubtreeSized<AugData> {
+        return { _select(index), this };
+    }
+
+    // Monoid fold over the entries with keys in [lo, hi). Needs an Aggregate augmentation.
+    auto aggregate(const K& lo, const K& hi) const requires Aggregating<Augment> {
+        if (compare(lo, hi) >= 0)
+            return Augment::Monoid::identity();
+        return _aggregate(lo, hi);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K> && Aggregating<Augment>
+    auto aggregate(const Q& lo, const Q& hi) const {
+        if (compare(lo, hi) >= 0)
+            return Augment::Monoid::identity();
+        return _aggregate(lo, hi);
+    }
+
+    // Monoid fold over the whole map.
+    auto aggregate() const requires Aggregating<Augment> {
+        return root ? root->aug.total : Augment::Monoid::identity();
+    }
+
+    // Entries with keys in [lo, hi), found with two descents and then streamed in order.
+    Range range(const K& lo, const K& hi) {
+        if (compare(lo, hi) >= 0)
+            return { entry_end(), entry_end() };
+        return { lower_bound(lo), lower_bound(hi) };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    Range range(const Q& lo, const Q& hi) {
+        if (compare(lo, hi) >= 0)
+            return { entry_end(), entry_end() };
+        return { lower_bound(lo), lower_bound(hi) };
+    }
+    ConstRange range(const K& lo, const K& hi) const {
+        if (compare(lo, hi) >= 0)
+            return { entry_cend(), entry_cend() };
+        return { lower_bound(lo), lower_bound(hi) };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    ConstRange range(const Q& lo, const Q& hi) const {
+        if (compare(lo, hi) >= 0)
+            return { entry_cend(), entry_cend() };
+        return { lower_bound(lo), lower_bound(hi) };
+    }
+
+    // Immutable copy for lookup-heavy phases, laid out in O(n) from the in-order entries.
+    FrozenTreeMap<K, V, Compare> freeze() const {
+        return FrozenTreeMap<K, V, Compare>::from_sorted(entry_cbegin(), entry_cend(), compare);
+    }
+};
+
+template <typename K, typename V, typename Compare, typename Nodes, typename Augment>
+std::ostream& operator<<(std::ostream& out, const TreeMap<K, V, Compare, Nodes, Augment>& tree) {
+    tree.print(out);
+    return out;
+}
+
+// Read-only copy of a sorted map laid out in Eytzinger (BFS) order: the children of slot k
+// sit at 2k and 2k + 1, so the first levels of every search share a few cache lines and the
+// slots a search will touch next can be prefetched. Keys and values are kept apart so a
+// search only streams keys. Slot k (one-based) is stored at index k - 1.
+template <typename K, typename V, typename Compare>
+struct FrozenTreeMap {
+private:
+    // Slots four levels below k start at 16k, one cache line ahead for 4-byte keys.
+    static constexpr size_t PREFETCH_STRIDE = 16;
+
+    std::vector<K> key_store;
+    std::vector<V> value_store;
+    size_t _size;
+    [[no_unique_address]] Compare compare;
+
+    // Records which in-order position lands in each slot of the subtree rooted at `slot`.
+    static void _layout(std::vector<size_t>& order, size_t slot, size_t& position) {
+        if (slot > order.size())
+            return;
+        _layout(order, slot * 2, position);
+        order[slot - 1] = position ++;
+        _layout(order, slot * 2 + 1, position);
+    }
+
+    // Slot of the first key not less than `key`, or 0. The descent is branchless: each step
+    // appends the comparison bit to the slot index, and the trailing ones (right turns after
+    // the last left turn) are shifted off at the end.
+    template<typename Q>
+    size_t _lower_slot(const Q& key) const {
+        const K* keys = key_store.data();
+        size_t slot = 1;
+        while (slot <= _size) {
+            if (slot * PREFETCH_STRIDE <= _size)
+                __builtin_prefetch(keys + slot * PREFETCH_STRIDE - 1);
+            slot = slot * 2 + (compare(keys[slot - 1], key) < 0);
+        }
+        return slot >> (std::countr_one(slot) + 1);
+    }
+
+    template<typename Q>
+    const V* _find(const Q& key) const {
+        size_t slot = _lower_slot(key);
+        if (slot && compare(key, key_store[slot - 1]) == 0)
+            return &value_store[slot - 1];
+        return nullptr;
+    }
+
+    // In-order neighbours of a slot, 0 past either end.
+    size_t _first_slot() const {
+        size_t slot = 1;
+        if (_size == 0) return 0;
+        while (slot * 2 <= _size) slot *= 2;
+        return slot;
+    }
+
+    size_t _next_slot(size_t slot) const {
+        if (slot * 2 + 1 <= _size) {
+            slot = slot * 2 + 1;
+            while (slot * 2 <= _size) slot *= 2;
+            return slot;
+        }
+        return slot >> (std::countr_one(slot) + 1);
+    }
+
+public:
+    FrozenTreeMap() :
+        _size(0) {}
+
+    // Lays out entries sorted by strictly increasing key in O(n).
+    template<std::forward_iterator It>
+    static FrozenTreeMap from_sorted(It first, It last, Compare compare = Compare()) {
+        FrozenTreeMap frozen;
+        frozen.compare = std::move(compare);
+        frozen._size = std::distance(first, last);
+
+        std::vector<const K*> sorted_keys;
+        std::vector<const V*> sorted_values;
+        sorted_keys.reserve(frozen._size);
+        sorted_values.reserve(frozen._size);
+        for (; first != last; ++ first) {
+            const auto& [ key, value ] = *first;
+            sorted_keys.push_back(&key);
+            sorted_values.push_back(&value);
+        }
+
+        std::vector<size_t> order(frozen._size);
+        size_t position = 0;
+        _layout(order, 1, position);
+
+        frozen.key_store.reserve(frozen._size);
+        frozen.value_store.reserve(frozen._size);
+        for (size_t index : order) {
+            frozen.key_store.push_back(*sorted_keys[index]);
+            frozen.value_store.push_back(*sorted_values[index]);
+        }
+        return frozen;
+    }
+
+    FrozenTreeMap(const FrozenTreeMap&) = delete;
+    FrozenTreeMap& operator=(const FrozenTreeMap&) = delete;
+
+    FrozenTreeMap(FrozenTreeMap&& that) noexcept :
+        key_store(std::move(that.key_store)),
+        value_store(std::move(that.value_store)),
+        _size(std::exchange(that._size, 0)),
+        compare(std::move(that.compare)) {}
+
+    FrozenTreeMap& operator=(FrozenTreeMap&& that) noexcept {
+        std::swap(key_store, that.key_store);
+        std::swap(value_store, that.value_store);
+        std::swap(_size, that._size);
+        std::swap(compare, that.compare);
+        return *this;
+    }
+
+    const size_t& size = _size;
+
+    inline bool empty() const {
+        return _size == 0;
+    }
+
+    const V* find(const K& key) const {
+        return _find(key);
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V* find(const Q& key) const {
+        return _find(key);
+    }
+
+    bool contains(const K& key) const {
+        return _find(key) != nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return _find(key) != nullptr;
+    }
+
+    const V& get(const K& key) const {
+        if (const V* value = _find(key))
+            return *value;
+        throw std::out_of_range(std::format("Key '{}' not found", key));
+    }
+
+    const V& get_or_else(const K& key, const V& def) const {
+        const V* value = _find(key);
+        return value ? *value : def;
+    }
+
+    // Iterators are a slot, walked in key order.
+    template<typename VI, typename Derefer>
+    struct IteratorBase {
+    private:
+        size_t slot;
+        const FrozenTreeMap* map;
+        [[no_unique_address]] std::remove_const_t<Derefer> deref {};
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::remove_cvref_t<VI>;
+        using difference_type = std::ptrdiff_t;
+        using reference = VI;
+
+        IteratorBase() :
+            slot(0),
+            map(nullptr) {}
+
+        IteratorBase(size_t slot, const FrozenTreeMap* map) :
+            slot(slot),
+            map(map) {}
+
+        IteratorBase& operator++() {
+            slot = map->_next_slot(slot);
+            return *this;
+        }
+        IteratorBase operator++(int) {
+            IteratorBase old = *this;
+            ++ *this;
+            return old;
+        }
+
+        VI operator*() const {
+            return deref(map, slot - 1);
+        }
+
+        operator bool() const {
+            return slot != 0;
+        }
+
+        bool operator==(const IteratorBase& that) const {
+            return slot == that.slot;
+        }
+    };
+
+    using ConstEntry = std::pair<const K&, const V&>;
+    static constexpr auto ConstEntryDerefer = [](const FrozenTreeMap* map, size_t index) -> ConstEntry {
+        return { map->key_store[index], map->value_store[index] };
+    };
+    using ConstEntryIterator = IteratorBase<ConstEntry, decltype(ConstEntryDerefer)>;
+    ConstEntryIterator entry_cbegin() const {
+        return { _first_slot(), this };
+    }
+    inline ConstEntryIterator entry_cend() const {
+        return { 0, this };
+    }
+
+    struct Entries {
+        const FrozenTreeMap& map;
+
+        Entries(const FrozenTreeMap& map) : map(map) {}
+
+        ConstEntryIterator begin() const {
+            return map.entry_cbegin();
+        }
+        ConstEntryIterator end() const {
+            return map.entry_cend();
+        }
+    } entries { *this };
+
+    static constexpr auto KeyDerefer = [](const FrozenTreeMap* map, size_t index) -> const K& {
+        return map->key_store[index];
+    };
+    using KeyIterator = IteratorBase<const K&, decltype(KeyDerefer)>;
+    KeyIterator key_begin() const {
+        return { _first_slot(), this };
+    }
+    inline KeyIterator key_end() const {
+        return { 0, this };
+    }
+
+    struct Keys {
+        const FrozenTreeMap& map;
+
+        Keys(const FrozenTreeMap& map) : map(map) {}
+
+        KeyIterator begin() const {
+            return map.key_begin();
+        }
+        KeyIterator end() const {
+            return map.key_end();
+        }
+    } keys { *this };
+
+    // First entry whose key is not less than `key`.
+    ConstEntryIterator lower_bound(const K& key) const {
+        return { _lower_slot(key), this };
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    ConstEntryIterator lower_bound(const Q& key) const {
+        return { _lower_slot(key), this };
+    }
+};
+
+// Immutable red-black map: `set` and `remove` copy the nodes on the way to the change
+// and return a new version sharing every other subtree, so snapshots are O(1) copies.
+template <typename K, typename V, typename Compare = std::compare_three_way>
+struct PersistentTreeMap {
+private:
+    enum class Color : bool {
+        RED,
+        BLACK,
+    };
+
+    struct Node;
+    using PNode = std::shared_ptr<const Node>;
+
+    struct Node {
+        K           key;
+        V           value;
+        Color       color;
+        PNode       left;
+        PNode       right;
+
+        explicit Node(K key, V value, Color color, PNode left, PNode right) :
+            key(std::move(key)),
+            value(std::move(value)),
+            color(color),
+            left(std::move(left)),
+            right(std::move(right)) {}
+    };
+
+    PNode root;
+    size_t _size;
+    [[no_unique_address]] Compare compare;
+
+    PersistentTreeMap(PNode root, size_t size, const Compare& compare) :
+        root(std::move(root)),
+        _size(size),
+        compare(compare) {}
+
+    static bool _is_red(const PNode& node) {
+        return node && node->color == Color::RED;
+    }
+
+    static PNode _make(const K& key, const V& value, Color color, PNode left, PNode right) {
+        return std::make_shared<const Node>(key, value, color, std::move(left), std::move(right));
+    }
+
+    static PNode _with_color(const PNode& node, Color color) {
+        if (! node || node->color == color)
+            return node;
+        return _make(node->key, node->value, color, node->left, node->right);
+    }
+
+    static int _black_height(const Node* node) {
+        int height = 0;
+        for (; node; node = node->left.get())
+            if (node->color == Color::BLACK) ++ height;
+        return height;
+    }
+
+    // Okasaki's rebalancing of a black node with a red child and a red grandchild.
+    static PNode _balance(const K& key, const V& value, Color color, PNode left, PNode right) {
+        if (color == Color::BLACK) {
+            if (_is_red(left) && _is_red(left->left))
+                return _make(left->key, left->value, Color::RED,
+                    _with_color(left->left, Color::BLACK),
+                    _make(key, value, Color::BLACK, left->right, std::move(right)));
+            if (_is_red(left) && _is_red(left->right))
+                return _make(left->right->key, left->right->value, Color::RED,
+                    _make(left->key, left->value, Color::BLACK, left->left, left->right->left),
+                    _make(key, value, Color::BLACK, left->right->right, std::move(right)));
+            if (_is_red(right) && _is_red(right->left))
+                return _make(right->left->key, right->left->value, Color::RED,
+                    _make(key, value, Color::BLACK, std::move(left), right->left->left),
+                    _make(right->key, right->value, Color::BLACK, right->left->right, right->right));
+            if (_is_red(right) && _is_red(right->right))
+                return _make(right->key, right->value, Color::RED,
+                    _make(key, value, Color::BLACK, std::move(left), right->left),
+                    _with_color(right->right, Color::BLACK));
+        }
+        return _make(key, value, color, std::move(left), std::move(right));
+    }
+
+    PNode _insert(const PNode& node, const K& key, const V& value, bool& inserted) const {
+        if (! node) {
+            inserted = true;
+            return _make(key, value, Color::RED, nullptr, nullptr);
+        }
+        auto order = compare(key, node->key);
+        if (order < 0)
+            return _balance(node->key, node->value, node->color, _insert(node->left, key, value, inserted), node->right);
+        if (order > 0)
+            return _balance(node->key, node->value, node->color, node->left, _insert(node->right, key, value, inserted));
+        return _make(node->key, value, node->color, node->left, node->right);
+    }
+
+    static PNode _join_right(const PNode& left, int left_height, const Node& mid, PNode right, int right_height) {
+        if (left_height == right_height && ! _is_red(left))
+            return _make(mid.key, mid.value, Color::RED, left, std::move(right));
+
+        int child_height = left_height - (_is_red(left) ? 0 : 1);
+        PNode child = _join_right(left->right, child_height, mid, std::move(right), right_height);
+        if (! _is_red(left) && _is_red(child) && _is_red(child->right))
+            return _make(child->key, child->value, Color::RED,
+                _make(left->key, left->value, Color::BLACK, left->left, child->left),
+                _with_color(child->right, Color::BLACK));
+        return _make(left->key, left->value, left->color, left->left, std::move(child));
+    }
+
+    static PNode _join_left(PNode left, int left_height, const Node& mid, const PNode& right, int right_height) {
+        if (left_height == right_height && ! _is_red(right))
+            return _make(mid.key, mid.value, Color::RED, std::move(left), right);
+
+        int child_height = right_height - (_is_red(right) ? 0 : 1);
+        PNode child = _join_left(std::move(left), left_height, mid, right->left, child_height);
+        if (! _is_red(right) && _is_red(child) && _is_red(child->left))
+            return _make(child->key, child->value, Color::RED,
+                _with_color(child->left, Color::BLACK),
+                _make(right->key, right->value, Color::BLACK, child->right, right->right));
+        return _make(right->key, right->value, right->color, std::move(child), right->right);
+    }
+
+    // Every key in `left` < `mid.key` < every key in `right`; only `mid`'s entry is copied.
+    static PNode _join(PNode left, const Node& mid, PNode right) {
+        left = _with_color(left, Color::BLACK);
+        right = _with_color(right, Color::BLACK);
+
+        int left_height = _black_height(left.get());
+        int right_height = _black_height(right.get());
+        if (left_height > right_height) {
+            PNode joined = _join_right(left, left_height, mid, std::move(right), right_height);
+            if (_is_red(joined) && _is_red(joined->right))
+                return _with_color(joined, Color::BLACK);
+            return joined;
+        }
+        if (left_height < right_height) {
+            PNode joined = _join_left(std::move(left), left_height, mid, right, right_height);
+            if (_is_red(joined) && _is_red(joined->left))
+                return _with_color(joined, Color::BLACK);
+            return joined;
+        }
+        return _make(mid.key, mid.value, Color::RED, std::move(left), std::move(right));
+    }
+
+    static std::pair<PNode, PNode> _split_last(const PNode& node) {
+        if (! node->right)
+            return { node->left, node };
+        auto [ rest, last ] = _split_last(node->right);
+        return { _join(node->left, *node, std::move(rest)), std::move(last) };
+    }
+
+    static PNode _join2(PNode left, PNode right) {
+        if (! left) return right;
+        if (! right) return left;
+        auto [ rest, last ] = _split_last(left);
+        return _join(std::move(rest), *last, std::move(right));
+    }
+
+    struct Split {
+        PNode left;
+        bool found;
+        PNode right;
+    };
+
+    template<typename Q>
+    Split _split(const PNode& node, const Q& key) const {
+        if (! node)
+            return { nullptr, false, nullptr };
+
+        auto order = compare(key, node->key);
+        if (order == 0)
+            return { node->left, true, node->right };
+        if (order < 0) {
+            Split split = _split(node->left, key);
+            return { std::move(split.left), split.found, _join(std::move(split.right), *node, node->right) };
+        }
+        Split split = _split(node->right, key);
+        return { _join(node->left, *node, std::move(split.left)), split.found, std::move(split.right) };
+    }
+
+    template<typename Q>
+    const Node* _find(const Q& key) const {
+        const Node* node = root.get();
+        while (node) {
+            auto order = compare(key, node->key);
+            if (order < 0)
+                node = node->left.get();
+            else if (order > 0)
+                node = node->right.get();
+            else
+                break;
+        }
+        return node;
+    }
+
+public:
+    PersistentTreeMap() :
+        root(nullptr),
+        _size(0) {}
+
+    explicit PersistentTreeMap(Compare compare) :
+        root(nullptr),
+        _size(0),
+        compare(std::move(compare)) {}
+
+    size_t size() const {
+        return _size;
+    }
+
+    bool empty() const {
+        return _size == 0;
+    }
+
+    const V* find(const K& key) const {
+        const Node* node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    const V* find(const Q& key) const {
+        const Node* node = _find(key);
+        return node ? &node->value : nullptr;
+    }
+
+    bool contains(const K& key) const {
+        return _find(key) != nullptr;
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return _find(key) != nullptr;
+    }
+
+    const V& get(const K& key) const {
+        if (const V* value = find(key))
+            return *value;
+        throw std::out_of_range(std::format("Key '{}' not found", key));
+    }
+
+    const V& get_or_else(const K& key, const V& def) const {
+        const V* value = find(key);
+        return value ? *value : def;
+    }
+
+    // A new version with `key` mapped to `value`; this version is left untouched.
+    PersistentTreeMap set(const K& key, const V& value) const {
+        bool inserted = false;
+        PNode next = _with_color(_insert(root, key, value, inserted), Color::BLACK);
+        return { std::move(next), _size + inserted, compare };
+    }
+
+    // A new version without `key`, or this version if the key is absent.
+    // Checks first, as splitting along the path copies its nodes even when nothing is removed.
+    PersistentTreeMap remove(const K& key) const {
+        if (! _find(key))
+            return *this;
+        Split split = _split(root, key);
+        PNode next = _with_color(_join2(std::move(split.left), std::move(split.right)), Color::BLACK);
+        return { std::move(next), _size - 1, compare };
+    }
+
+    using ConstEntry = std::pair<const K&, const V&>;
+
+    // In-order iterator keeping the path to the current node, since nodes have no parent links.
+    struct Iterator {
+    private:
+        std::vector<const Node*> stack;
+
+        void push_lefts(const Node* node) {
+            for (; node; node = node->left.get())
+                stack.push_back(node);
+        }
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<K, V>;
+        using difference_type = std::ptrdiff_t;
+        using reference = ConstEntry;
+
+        Iterator() = default;
+
+        explicit Iterator(const Node* root) {
+            push_lefts(root);
+        }
+
+        Iterator& operator++() {
+            const Node* top = stack.back();
+            stack.pop_back();
+            push_lefts(top->right.get());
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator old = *this;
+            ++ *this;
+            return old;
+        }
+
+        ConstEntry operator*() const {
+            return { stack.back()->key, stack.back()->value };
+        }
+
+        bool operator==(const Iterator& that) const {
+            if (stack.empty() || that.stack.empty())
+                return stack.empty() == that.stack.empty();
+            return stack.back() == that.stack.back();
+        }
+    };
+
+    Iterator begin() const {
+        return Iterator { root.get() };
+    }
+    Iterator end() const {
+        return {};
+    }
+};
+
+// Epoch-based reclamation: readers announce the global epoch while they are inside,
+// retired objects are deleted once the epoch has moved two steps past their retirement,
+// at which point no reader can still see them.
+// `retire` and `reclaim` must be serialized by the caller.
+// Each pinned reader holds one of SLOTS announcement slots; with more readers pinned at once,
+// `pin` spins until a slot is released, so readers are lock-free only up to SLOTS at a time.
+template <typename T>
+struct EpochDomain {
+private:
+    static constexpr size_t SLOTS = 128;
+    static constexpr uint64_t IDLE = 0;
+
+    struct alignas(64) Slot {
+        std::atomic<bool> taken { false };
+        std::atomic<uint64_t> epoch { IDLE };
+    };
+
+    std::array<Slot, SLOTS> slots;
+    std::atomic<uint64_t> epoch { 1 };
+    std::vector<std::pair<uint64_t, const T*>> retired;
+
+    bool _try_advance() {
+        uint64_t current = epoch.load();
+        for (const Slot& slot : slots) {
+            uint64_t announced = slot.epoch.load();
+            if (announced != IDLE && announced != current)
+                return false;
+        }
+        epoch.store(current + 1);
+        return true;
+    }
+
+public:
+    EpochDomain() = default;
+    EpochDomain(const EpochDomain&) = delete;
+    EpochDomain& operator=(const EpochDomain&) = delete;
+
+    ~EpochDomain() {
+        for (auto [ _, object ] : retired)
+            delete object;
+    }
+
+    struct Guard {
+    private:
+        Slot* slot;
+
+    public:
+        // Busy-waits while all SLOTS slots are taken.
+        explicit Guard(EpochDomain& domain) {
+            size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for (size_t i = start; ; ++ i) {
+                Slot& candidate = domain.slots[i % SLOTS];
+                if (! candidate.taken.load(std::memory_order_relaxed) && ! candidate.taken.exchange(true, std::memory_order_acquire)) {
+                    slot = &candidate;
+                    break;
+                }
+            }
+            slot->epoch.store(domain.epoch.load());
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard() {
+            slot->epoch.store(IDLE, std::memory_order_release);
+            slot->taken.store(false, std::memory_order_release);
+        }
+    };
+
+    Guard pin() {
+        return Guard { *this };
+    }
+
+    void retire(const T* object) {
+        retired.emplace_back(epoch.load(), object);
+    }
+
+    void reclaim() {
+        _try_advance();
+        uint64_t safe = epoch.load();
+        std::erase_if(retired, [safe](const auto& entry) {
+            if (entry.first + 2 > safe)
+                return false;
+            delete entry.second;
+            return true;
+        });
+    }
+};
+
+// Read-mostly concurrent map: every write publishes a new PersistentTreeMap version
+// with an atomic pointer swap, so readers never lock and never touch reference counts.
+// Writers are serialized by a mutex; replaced versions are freed through an EpochDomain.
+// Reads are lock-free for up to 128 concurrent readers, the EpochDomain's slot count;
+// beyond that a reader spins in `pin` until another one finishes.
+template <typename K, typename V, typename Compare = std::compare_three_way>
+struct ConcurrentTreeMap {
+public:
+    using Version = PersistentTreeMap<K, V, Compare>;
+
+private:
+    std::atomic<const Version*> current;
+    std::mutex writer;
+    mutable EpochDomain<Version> epochs;
+
+    void _publish(const Version* next) {
+        const Version* old = current.exchange(next);
+        epochs.retire(old);
+        epochs.reclaim();
+    }
+
+public:
+    ConcurrentTreeMap() :
+        current(new Version()) {}
+
+    explicit ConcurrentTreeMap(Compare compare) :
+        current(new Version(std::move(compare))) {}
+
+    ConcurrentTreeMap(const ConcurrentTreeMap&) = delete;
+    ConcurrentTreeMap& operator=(const ConcurrentTreeMap&) = delete;
+
+    ~ConcurrentTreeMap() {
+        delete current.load();
+    }
+
+    // Runs `func` on the current version without copying it.
+    // References obtained inside must not outlive the call.
+    template<typename F>
+    decltype(auto) read(F&& func) const {
+        auto guard = epochs.pin();
+        return std::forward<F>(func)(*current.load());
+    }
+
+    // A consistent point-in-time copy that stays valid regardless of later writes.
+    Version snapshot() const {
+        return read([](const Version& version) {
+            return version;
+        });
+    }
+
+    size_t size() const {
+        return read([](const Version& version) {
+            return version.size();
+        });
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::optional<V> find(const K& key) const {
+        return read([&key](const Version& version) -> std::optional<V> {
+            if (const V* value = version.find(key))
+                return *value;
+            return std::nullopt;
+        });
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    std::optional<V> find(const Q& key) const {
+        return read([&key](const Version& version) -> std::optional<V> {
+            if (const V* value = version.find(key))
+                return *value;
+            return std::nullopt;
+        });
+    }
+
+    bool contains(const K& key) const {
+        return read([&key](const Version& version) {
+            return version.contains(key);
+        });
+    }
+    template<typename Q> requires TransparentFor<Compare, Q, K>
+    bool contains(const Q& key) const {
+        return read([&key](const Version& version) {
+            return version.contains(key);
+        });
+    }
+
+    V get(const K& key) const {
+        return read([&key](const Version& version) {
+            return version.get(key);
+        });
+    }
+
+    V get_or_else(const K& key, const V& def) const {
+        return read([&key, &def](const Version& version) {
+            return version.get_or_else(key, def);
+        });
+    }
+
+    void set(const K& key, const V& value) {
+        std::lock_guard lock(writer);
+        _publish(new Version(current.load()->set(key, value)));
+    }
+
+    bool remove(const K& key) {
+        std::lock_guard lock(writer);
+        const Version* version = current.load();
+        Version next = version->remove(key);
+        if (next.size() == version->size())
+            return false;
+        _publish(new Version(std::move(next)));
+        return true;
+    }
+};
+
+// Hash-partitioned front-end over independent TreeMaps, each behind its own lock,
+// so operations on different shards never contend.
+template <
+    typename K,
+    typename V,
+    typename Compare = std::compare_three_way,
+    typename Hash = std::hash<K>,
+    typename Nodes = HeapNodes
+>
+struct ShardedTreeMap {
+public:
+    using Map = TreeMap<K, V, Compare, Nodes>;
+    using ConstEntry = typename Map::ConstEntry;
+
+private:
+    struct alignas(64) Shard {
+        mutable std::shared_mutex lock;
+        Map map;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    size_t _shard_count;
+    [[no_unique_address]] Hash hash;
+    [[no_unique_address]] Compare compare;
+
+    Shard& _shard(const K& key) const {
+        return shards[hash(key) % _shard_count];
+    }
+
+    template<typename F>
+    decltype(auto) _read(const K& key, F&& func) const {
+        Shard& shard = _shard(key);
+        std::shared_lock lock(shard.lock);
+        return std::forward<F>(func)(std::as_const(shard.map));
+    }
+
+    template<typename F>
+    decltype(auto) _write(const K& key, F&& func) {
+        Shard& shard = _shard(key);
+        std::unique_lock lock(shard.lock);
+        return std::forward<F>(func)(shard.map);
+    }
+
+public:
+    // A count of 0 is taken as 1, since keys are spread by `hash(key) % shard_count`.
+    explicit ShardedTreeMap(size_t shard_count = std::max(std::thread::hardware_concurrency(), 1u)) :
+        shards(new Shard[std::max<size_t>(shard_count, 1)]),
+        _shard_count(std::max<size_t>(shard_count, 1)) {}
+
+    size_t shard_count() const {
+        return _shard_count;
+    }
+
+    // Sum of the shard sizes, each read under its own lock.
+    size_t size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < _shard_count; ++ i) {
+            std::shared_lock lock(shards[i].lock);
+            total += shards[i].map.size;
+        }
+        return total;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    std::optional<V> find(const K& key) const {
+        return _read(key, [&key](const Map& map) -> std::optional<V> {
+            if (const V* value = map.find(key))
+                return *value;
+            return std::nullopt;
+        });
+    }
+
+    bool contains(const K& key) const {
+        return _read(key, [&key](const Map& map) {
+            return map.contains(key);
+        });
+    }
+
+    V get(const K& key) const {
+        return _read(key, [&key](const Map& map) {
+            return map.get(key);
+        });
+    }
+
+    V get_or_else(const K& key, const V& def) const {
+        return _read(key, [&key, &def](const Map& map) {
+            return map.get_or_else(key, def);
+        });
+    }
+
+    void set(const K& key, const V& value) {
+        _write(key, [&key, &value](Map& map) {
+            map.set(key, value);
+        });
+    }
+
+    template<typename F>
+    bool update(const K& key, F&& func) {
+        return _write(key, [&key, &func](Map& map) {
+            return map.update(key, std::forward<F>(func));
+        });
+    }
+
+    bool remove(const K& key) {
+        return _write(key, [&key](Map& map) {
+            return map.remove(key);
+        });
+    }
+
+    // In-order merge of the shards' entry iterators through a min-heap keyed on the current keys.
+    struct MergedIterator {
+    private:
+        using ShardIterator = typename Map::ConstEntryIterator;
+
+        std::vector<std::pair<ShardIterator, ShardIterator>> cursors;
+        std::vector<size_t> heap;
+        const Compare* compare;
+
+        bool _later(size_t a, size_t b) const {
+            return (*compare)((*cursors[a].first).first, (*cursors[b].first).first) > 0;
+        }
+
+        void _push(size_t index) {
+            if (cursors[index].first == cursors[index].second)
+                return;
+            heap.push_back(index);
+            std::ranges::push_heap(heap, [this](size_t a, size_t b) {
+                return _later(a, b);
+            });
+        }
+
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::pair<K, V>;
+        using difference_type = std::ptrdiff_t;
+        using reference = ConstEntry;
+
+        MergedIterator() :
+            compare(nullptr) {}
+
+        MergedIterator(const ShardedTreeMap& sharded) :
+            compare(&sharded.compare) {
+            for (size_t i = 0; i < sharded._shard_count; ++ i) {
+                const Map& map = sharded.shards[i].map;
+                cursors.emplace_back(map.entry_cbegin(), map.entry_cend());
+                _push(i);
+            }
+        }
+
+        MergedIterator& operator++() {
+            std::ranges::pop_heap(heap, [this](size_t a, size_t b) {
+                return _later(a, b);
+            });
+            size_t index = heap.back();
+            heap.pop_back();
+            ++ cursors[index].first;
+            _push(index);
+            return *this;
+        }
+
+        ConstEntry operator*() const {
+            return *cursors[heap.front()].first;
+        }
+
+        bool operator==(std::default_sentinel_t) const {
+            return heap.empty();
+        }
+    };
+
+    // Holds every shard's lock shared, taken in shard order, for as long as it lives.
+    struct Entries {
+    private:
+        const ShardedTreeMap& sharded;
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+
+    public:
+        explicit Entries(const ShardedTreeMap& sharded) :
+            sharded(sharded) {
+            for (size_t i = 0; i < sharded._shard_count; ++ i)
+                locks.emplace_back(sharded.shards[i].lock);
+        }
+
+        MergedIterator begin() const {
+            return { sharded };
+        }
+        std::default_sentinel_t end() const {
+            return {};
+        }
+    };
+
+    Entries entries() const {
+        return Entries { *this };
+    }
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <concepts>
+
+// Comparators tagged `is_transparent` may be called with keys of other types,
+// which lets lookups skip building a K (e.g. a std::string from a std::string_view).
+template <typename Compare>
+concept TransparentCompare = requires {
+    typename Compare::is_transparent;
+};
+
+// Heterogeneous overloads only kick in for lookup types the comparator accepts,
+// anything else falls back to converting to K.
+template <typename Compare, typename Q, typename K>
+concept TransparentFor = TransparentCompare<Compare>
+    && std::invocable<const Compare&, const Q&, const K&>
+    && std::invocable<const Compare&, const K&, const Q&>;